@@ -1,7 +1,8 @@
 function(clap_juce_extensions_plugin_internal)
     set(oneValueArgs TARGET TARGET_PATH PLUGIN_BINARY_NAME IS_JUCER PLUGIN_VERSION DO_COPY CLAP_MANUAL_URL
             CLAP_SUPPORT_URL CLAP_MISBEHAVIOUR_HANDLER_LEVEL CLAP_CHECKING_LEVEL CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES
-            CLAP_ALWAYS_SPLIT_BLOCK CLAP_USE_JUCE_PARAMETER_RANGES CLAP_SUPPORTS_CUSTOM_FACTORY)
+            CLAP_ALWAYS_SPLIT_BLOCK CLAP_USE_JUCE_PARAMETER_RANGES CLAP_SUPPORTS_CUSTOM_FACTORY
+            CLAP_PROCESSING_PRECISION CLAP_FIXED_BLOCK_SIZE)
     set(multiValueArgs CLAP_ID CLAP_FEATURES)
   
     cmake_parse_arguments(CJA "" "${oneValueArgs}" "${multiValueArgs}" ${ARGN})
@@ -47,6 +48,12 @@ function(clap_juce_extensions_plugin_internal)
         message( STATUS "Setting \"Always split block\" to ${CJA_CLAP_ALWAYS_SPLIT_BLOCK}")
     endif()
 
+    if ("${CJA_CLAP_FIXED_BLOCK_SIZE}" STREQUAL "")
+        set(CJA_CLAP_FIXED_BLOCK_SIZE 0)
+    else()
+        message( STATUS "Setting fixed block size to ${CJA_CLAP_FIXED_BLOCK_SIZE} samples")
+    endif()
+
     if ("${CJA_CLAP_SUPPORTS_CUSTOM_FACTORY}" STREQUAL "")
         set(CJA_CLAP_SUPPORTS_CUSTOM_FACTORY 0)
     endif()
@@ -61,6 +68,12 @@ function(clap_juce_extensions_plugin_internal)
         message( STATUS "Setting \"Use JUCE parameter ranges\" to ${CJA_CLAP_USE_JUCE_PARAMETER_RANGES}")
     endif()
 
+    if ("${CJA_CLAP_PROCESSING_PRECISION}" STREQUAL "")
+        set(CJA_CLAP_PROCESSING_PRECISION NATIVE)
+    else()
+        message( STATUS "Setting processing precision to ${CJA_CLAP_PROCESSING_PRECISION}")
+    endif()
+
     # we need the list of features as comma separated quoted strings
     foreach(feature IN LISTS CJA_CLAP_FEATURES)
         list (APPEND CJA_CLAP_FEATURES_PARSED "\"${feature}\"")
@@ -142,8 +155,10 @@ function(clap_juce_extensions_plugin_internal)
             CLAP_CHECKING_LEVEL=${CJA_CLAP_CHECKING_LEVEL}
             CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES=${CJA_CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES}
             CLAP_ALWAYS_SPLIT_BLOCK=${CJA_CLAP_ALWAYS_SPLIT_BLOCK}
+            CLAP_FIXED_BLOCK_SIZE=${CJA_CLAP_FIXED_BLOCK_SIZE}
             CLAP_USE_JUCE_PARAMETER_RANGES=CLAP_USE_JUCE_PARAMETER_RANGES_${CJA_CLAP_USE_JUCE_PARAMETER_RANGES}
             CLAP_SUPPORTS_CUSTOM_FACTORY=${CJA_CLAP_SUPPORTS_CUSTOM_FACTORY}
+            CLAP_PROCESSING_PRECISION=CLAP_PROCESSING_PRECISION_${CJA_CLAP_PROCESSING_PRECISION}
             )
 
     if(${CJA_IS_JUCER})
@@ -36,6 +36,53 @@ class Colour;
 
 namespace clap_juce_extensions
 {
+/*
+ * clap_process_diagnostics contains counters which the wrapper updates while processing. They
+ * are written from the audio thread with relaxed ordering, so they are only meant for profiling
+ * and debugging displays.
+ */
+struct clap_process_diagnostics
+{
+    // How many host input channels JUCE processed in place, in the host's output (in-place
+    // pairs), and how many had to be copied, summed over all blocks. Only blocks where the
+    // processor runs straight on the host buffers count: converting precision, a fixed block
+    // size and the worker thread copy every channel.
+    std::atomic<uint64_t> aliased_channels{0}, copied_channels{0};
+
+    // How many output channels were flagged as constant to the host, summed over all blocks.
+    // Only counted if supportsConstantOutputDetection() returns true.
+    std::atomic<uint64_t> constant_output_channels{0};
+
+    // How many times the MIDI buffer handed to processBlock had to grow on the audio thread.
+    // This should stay at 0; the wrapper reserves more at the next activation if it doesn't.
+    std::atomic<uint64_t> midi_buffer_allocations{0};
+
+    // How many times a block brought more input events than the wrapper had room for, so the
+    // list it copies them into had to grow on the audio thread.
+    std::atomic<uint64_t> input_event_allocations{0};
+
+    // How many output events (MIDI, sysex or the plugin's own) didn't fit in the room the
+    // wrapper reserved for a block's output. The next activation reserves enough for them.
+    std::atomic<uint64_t> dropped_output_events{0};
+
+    // How many input events didn't fit in the worker thread's copy of a block's events (see
+    // supportsWorkerThreadProcessing()). Note offs have room kept back for them, so they are
+    // the last to go. The next activation reserves enough for the busiest block so far.
+    std::atomic<uint64_t> dropped_input_events{0};
+};
+
+/*
+ * The sample type the wrapper should run your processBlock with. See
+ * clap_juce_audio_processor_capabilities::getProcessingPrecision()
+ */
+enum class processing_precision
+{
+    cmake_default, // whatever CLAP_PROCESSING_PRECISION was set to in the CMake helper
+    native,        // use the host's buffers in whichever precision the host picked
+    always_float,  // always call processBlock with floats, converting if needed
+    always_double  // always call processBlock with doubles, converting if needed
+};
+
 /*
  * clap_properties contains simple properties about clap which you may want to use.
  */
@@ -56,6 +103,9 @@ struct clap_properties
     // The processing and active clap state
     std::atomic<bool> is_clap_active{false}, is_clap_processing{false};
 
+    // Counters from the clap process loop
+    clap_process_diagnostics clap_diagnostics;
+
     // Internal implementation detail. Please disregard (and FIXME)
     static bool building_clap;
 };
@@ -97,9 +147,137 @@ struct clap_juce_audio_processor_capabilities
     }
 
     /*
-     * Do you want to receive note expression messages? Note that if you return true
-     * here and don't implement supportsDirectProcess, the note expression messages will
-     * be received and ignored.
+     * By default the wrapper processes in whichever precision the host hands over, which means
+     * a double precision plugin only gets doubles from hosts which are happy to give them. If
+     * your DSP has a single fast path, you can force it here, and the wrapper will convert
+     * to and from the host buffers in scratch buffers which are allocated on activation.
+     * `always_double` requires supportsDoublePrecisionProcessing() to return true.
+     */
+    virtual processing_precision getProcessingPrecision()
+    {
+        return processing_precision::cmake_default;
+    }
+
+    /*
+     * Opt in to silence-aware processing. Once every input port is flagged as constant silence
+     * by the host, no events have arrived, and getTailLengthSeconds() has elapsed since the last
+     * non-silent input, the wrapper skips processBlock, clears the outputs and tells the host
+     * it can put the plugin to sleep (CLAP_PROCESS_SLEEP) until new input or events arrive.
+     *
+     * Don't opt in if your plugin can make sound with silent input and no events (held notes,
+     * free-running oscillators, infinite tails and so on).
+     */
+    virtual bool supportsSleepOnSilence() { return false; }
+
+    /*
+     * If true, the wrapper scans each output channel after processBlock and sets its bit in
+     * the output constant_mask when every sample is equal, so the host can skip work
+     * downstream of silence or DC. The scan stops at the first differing sample, so it is
+     * cheap for plugins which are usually producing sound, but it is still an extra pass.
+     */
+    virtual bool supportsConstantOutputDetection() { return false; }
+
+    /*
+     * Return a block size to have the wrapper always call processBlock with exactly that many
+     * samples (for FFT or partitioned convolution processing, say). The wrapper rebuffers the
+     * host's audio and re-times events into those blocks, which adds one block of latency on
+     * top of getLatencySamples(), reported to the host for you. Return 0 to turn this off, or
+     * -1 to use the CLAP_FIXED_BLOCK_SIZE given to clap_juce_extensions_plugin().
+     */
+    virtual int getFixedBlockSize() { return -1; }
+
+    /*
+     * Opt in to running processBlock on a dedicated worker thread, one block behind the host.
+     * The host's audio callback then only exchanges audio and events with the worker, so your
+     * processing gets a whole block period rather than sharing the host's deadline, at the
+     * cost of maxFrameCount samples of latency (reported to the host for you). Output queued
+     * from before a transport jump is replaced with silence. This isn't used together with
+     * supportsDirectProcess().
+     */
+    virtual bool supportsWorkerThreadProcessing() { return false; }
+
+    /*
+     * Parallel processing within a block, for rendering voices on several cores and so on.
+     * Return true from supportsParallelTasks(), then call submitParallelTasks(n) from
+     * processBlock. The wrapper calls parallelTaskExecute() once for each task index in
+     * [0, n), on the host's thread pool if it offers one and on a pool of threads owned by
+     * the wrapper otherwise, and returns once they have all finished. The wrapper starts its
+     * pool the first time it's needed, so that batch runs on the calling thread. Tasks may run
+     * at the same time on different threads, so they must not share mutable state, and must
+     * not call back into the wrapper (reportNoteEnded(), say): collect what they need to
+     * report and do it from processBlock once submitParallelTasks() has returned.
+     */
+    virtual bool supportsParallelTasks() { return false; }
+    virtual void parallelTaskExecute(uint32_t /*taskIndex*/) {}
+
+    /*
+     * Runs parallelTaskExecute() for every task index in [0, numTasks), returning once they
+     * are all done. Outside of the CLAP wrapper the tasks run one after another here.
+     */
+    void submitParallelTasks(uint32_t numTasks)
+    {
+        if (parallelTasksSignal != nullptr && parallelTasksSignal(numTasks))
+            return;
+
+        for (uint32_t i = 0; i < numTasks; ++i)
+            parallelTaskExecute(i);
+    }
+
+    /*
+     * Sets how finely the wrapper splits blocks at parameter and transport events, in samples,
+     * for realtime and for offline rendering. 0 processes whole blocks. For realtime, -1 uses
+     * the CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES given to clap_juce_extensions_plugin(), and
+     * for offline it uses whatever realtime uses. Both are -1 by default, so nothing changes
+     * when bouncing unless you ask for it: passing 1 for offline gets bounces sample-accurate
+     * automation without paying for it live. Safe to call from any thread; the wrapper picks
+     * up the change at its next block.
+     */
+    void setProcessEventsResolution(int realtimeSamples, int offlineSamples)
+    {
+        realtimeEventsResolution.store(realtimeSamples);
+        offlineEventsResolution.store(offlineSamples);
+    }
+
+    /*
+     * Called on the main thread when the host moves into or out of offline rendering, after
+     * isNonRealtime() has been updated. This is the place to switch to higher quality
+     * algorithms which couldn't keep up in realtime, or to set an offline resolution with
+     * setProcessEventsResolution() (0 gets whole host blocks, for throughput). While rendering
+     * offline the wrapper skips what is only there for realtime playback: it doesn't ask the
+     * host to flush parameter changes, since it keeps calling process() anyway, and with
+     * CLAP_ALWAYS_SPLIT_BLOCK it only splits blocks at events, not at every resolution step.
+     */
+    virtual void renderModeChanged(bool /*isOffline*/) {}
+
+    /*
+     * Return true to have the wrapper send CLAP_EVENT_NOTE_END for you, which hosts need for
+     * polyphonic modulation. The wrapper remembers the note id of every note on from the host,
+     * and when a voice finishes (in SynthesiserVoice::clearCurrentNote(), say) you call
+     * reportNoteEnded() from processBlock with the voice's MIDI channel (1-16) and note number,
+     * and the sample in the current buffer where it went quiet. Notes on the same channel and
+     * key are ended oldest first. Only call it on the thread running processBlock, and not from
+     * parallelTaskExecute(): the wrapper's note list isn't locked. Ends reported outside
+     * processBlock (from reset() or releaseResources(), say) go out at the start of the next
+     * block. Choked notes, and any notes still held when the wrapper is reset or deactivated,
+     * are ended by the wrapper itself.
+     */
+    virtual bool supportsNoteEndTracking() { return false; }
+
+    void reportNoteEnded(int midiChannel, int noteNumber, int samplePosition)
+    {
+        if (noteEndedSignal != nullptr)
+            noteEndedSignal(midiChannel, noteNumber, samplePosition);
+    }
+
+    /*
+     * Do you want to receive note expression messages? If you return true here, your
+     * processor's supportsMPE() returns true, and you don't handle CLAP_EVENT_NOTE_EXPRESSION
+     * with supportsDirectEvent() or supportsDirectProcess(), the wrapper translates them to MPE
+     * for you: each note from the host is moved to its own member channel of an MPE lower
+     * zone, with tuning sent as pitch bend (48 semitone range), pressure as channel pressure,
+     * brightness as CC74, volume as CC7 and pan as CC10. Set up your juce::MPEInstrument or
+     * juce::MPESynthesiser with that zone to play them. Without supportsMPE(), notes stay on
+     * the host's channels and expressions are dropped.
      */
     virtual bool supportsNoteExpressions() { return false; }
 
@@ -122,6 +300,9 @@ struct clap_juce_audio_processor_capabilities
     /**
      * If your plugin returns true for supportsDirectEvent, then you'll need to
      * implement this method to actually handle that event when it comes along.
+     * Parameter changes from before the event have already been applied when it's called,
+     * so the parameters read as they were at the event's time. MIDI is handled in
+     * processBlock, after all of the sub-block's changes have been applied.
      *
      * @param event         The header for the incoming event.
      * @param sampleOffset  If the CLAP wrapper has split up the incoming buffer (e.g. to
@@ -144,9 +325,9 @@ struct clap_juce_audio_processor_capabilities
      * called after your `processBlock()` method, so that any outbound events can be
      * added to the output event queue.
      *
-     * NOTE: if your plugin produces MIDI, you must take care to make sure that any outgoing
-     * events which are not MIDI events are correctly interleaved with the outgoing events
-     * from the midiBuffer, such that all the events in the output queue are ordered sequentially.
+     * The wrapper collects everything pushed to out_events during a block and sorts it by
+     * time before it goes to the host, so your events don't need to be interleaved with the
+     * MIDI from the midiBuffer by hand.
      *
      * @param out_events    The output event queue.
      * @param midiBuffer    The JUCE MIDI Buffer from the previous `processBlock()` call.
@@ -338,6 +519,18 @@ struct clap_juce_audio_processor_capabilities
         return nullptr;
     }
 
+    /*
+     * The wrapper asks the questions it needs while processing (supportsDirectProcess(),
+     * supportsDirectEvent(), supportsOutboundEvents() and so on) when the plugin is activated,
+     * and sticks with those answers until the next activation. If your answers change, call
+     * this from the main thread and the wrapper will ask the host to restart the plugin.
+     */
+    void capabilitiesChanged()
+    {
+        if (capabilitiesChangedSignal != nullptr)
+            capabilitiesChangedSignal();
+    }
+
     const void *getExtension(const char *name)
     {
         if (clapHostStatic != nullptr)
@@ -355,6 +548,10 @@ struct clap_juce_audio_processor_capabilities
     std::function<void()> remoteControlsChangedSignal = nullptr;
     std::function<void()> voiceInfoChangedSignal = nullptr;
     std::function<void(uint32_t)> suggestRemoteControlsPageSignal = nullptr;
+    std::function<void()> capabilitiesChangedSignal = nullptr;
+    std::function<bool(uint32_t)> parallelTasksSignal = nullptr;
+    std::function<void(int, int, int)> noteEndedSignal = nullptr;
+    std::atomic<int> realtimeEventsResolution{-1}, offlineEventsResolution{-1};
     std::function<void(uint32_t location_kind, const char *location, const char *load_key,
                        int32_t os_error, const juce::String &msg)>
         onPresetLoadError = nullptr;
@@ -390,7 +587,8 @@ struct clap_juce_parameter_capabilities
      * Return true if this parameter should receive non-destructive polyphonic modulation. If this
      * method returns true, then the host will also expect that the paramter can handle monophonic
      * modulation. Additionally, your plugin must return note end events when notes are terminated,
-     * by implementing either `addOutboundEventsToQueue()` or `clap_direct_process()`.
+     * either with supportsNoteEndTracking() and reportNoteEnded(), or by implementing
+     * `addOutboundEventsToQueue()` or `clap_direct_process()`.
      */
     virtual bool supportsPolyphonicModulation() { return false; }
 
@@ -13,6 +13,7 @@
 #include <unordered_set>
 #include <algorithm>
 #include <new>
+#include <thread>
 
 #define JUCE_GUI_BASICS_INCLUDE_XHEADERS 1
 #include <juce_core/system/juce_CompilerWarnings.h>
@@ -134,6 +135,113 @@ template <typename T, int qSize = 4096> class PushPopQ
     T dq[(size_t)qSize];
 };
 
+/*
+ * Sample type conversion for the mixed-precision bridge, used when the host hands us
+ * buffers in a different precision than the one the processor runs in, and constant
+ * detection for the output constant_mask.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLAP_JUCE_CONVERT_SSE2 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define CLAP_JUCE_CONVERT_NEON 1
+#endif
+
+static void convertSamples(double *dest, const float *src, int numSamples)
+{
+    int i = 0;
+#if CLAP_JUCE_CONVERT_SSE2
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        const auto in = _mm_loadu_ps(src + i);
+        _mm_storeu_pd(dest + i, _mm_cvtps_pd(in));
+        _mm_storeu_pd(dest + i + 2, _mm_cvtps_pd(_mm_movehl_ps(in, in)));
+    }
+#elif CLAP_JUCE_CONVERT_NEON
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        const auto in = vld1q_f32(src + i);
+        vst1q_f64(dest + i, vcvt_f64_f32(vget_low_f32(in)));
+        vst1q_f64(dest + i + 2, vcvt_high_f64_f32(in));
+    }
+#endif
+    for (; i < numSamples; ++i)
+        dest[i] = (double)src[i];
+}
+
+static void convertSamples(float *dest, const double *src, int numSamples)
+{
+    int i = 0;
+#if CLAP_JUCE_CONVERT_SSE2
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        const auto lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+        const auto hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+        _mm_storeu_ps(dest + i, _mm_movelh_ps(lo, hi));
+    }
+#elif CLAP_JUCE_CONVERT_NEON
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        const auto lo = vcvt_f32_f64(vld1q_f64(src + i));
+        vst1q_f32(dest + i, vcvt_high_f32_f64(lo, vld1q_f64(src + i + 2)));
+    }
+#endif
+    for (; i < numSamples; ++i)
+        dest[i] = (float)src[i];
+}
+
+JUCE_BEGIN_IGNORE_WARNINGS_GCC_LIKE("-Wfloat-equal")
+/** Is every sample equal to the first? Bails out on the first vector which differs. */
+static bool isConstant(const float *data, int numSamples)
+{
+    if (numSamples <= 0)
+        return true;
+
+    const auto first = data[0];
+    int i = 1;
+#if CLAP_JUCE_CONVERT_SSE2
+    const auto ref = _mm_set1_ps(first);
+    for (; i + 4 <= numSamples; i += 4)
+        if (_mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(data + i), ref)) != 0xf)
+            return false;
+#elif CLAP_JUCE_CONVERT_NEON
+    const auto ref = vdupq_n_f32(first);
+    for (; i + 4 <= numSamples; i += 4)
+        if (vminvq_u32(vceqq_f32(vld1q_f32(data + i), ref)) == 0)
+            return false;
+#endif
+    for (; i < numSamples; ++i)
+        if (data[i] != first)
+            return false;
+    return true;
+}
+
+static bool isConstant(const double *data, int numSamples)
+{
+    if (numSamples <= 0)
+        return true;
+
+    const auto first = data[0];
+    int i = 1;
+#if CLAP_JUCE_CONVERT_SSE2
+    const auto ref = _mm_set1_pd(first);
+    for (; i + 2 <= numSamples; i += 2)
+        if (_mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(data + i), ref)) != 0x3)
+            return false;
+#elif CLAP_JUCE_CONVERT_NEON
+    const auto ref = vdupq_n_f64(first);
+    for (; i + 2 <= numSamples; i += 2)
+        if (vminvq_u32(vreinterpretq_u32_u64(vceqq_f64(vld1q_f64(data + i), ref))) == 0)
+            return false;
+#endif
+    for (; i < numSamples; ++i)
+        if (data[i] != first)
+            return false;
+    return true;
+}
+JUCE_END_IGNORE_WARNINGS_GCC_LIKE
+
 #if JUCE_VERSION < 0x070006
 /*
  * These functions are the JUCE VST2/3 NSView attachment functions. We compile them into
@@ -171,6 +279,14 @@ JUCE_BEGIN_IGNORE_WARNINGS_MSVC(4996)
 #define CLAP_ALWAYS_SPLIT_BLOCK 0
 #endif
 
+#if !defined(CLAP_JUCE_SPECIALISE_PROCESS_LOOP)
+#define CLAP_JUCE_SPECIALISE_PROCESS_LOOP 1 // 0 builds the unspecialised loop, to benchmark it
+#endif
+
+#if !defined(CLAP_FIXED_BLOCK_SIZE)
+#define CLAP_FIXED_BLOCK_SIZE 0 // processBlock gets the host's block sizes by default
+#endif
+
 #define CLAP_USE_JUCE_PARAMETER_RANGES_OFF 0
 #define CLAP_USE_JUCE_PARAMETER_RANGES_DISCRETE 1
 #define CLAP_USE_JUCE_PARAMETER_RANGES_ALL 2
@@ -179,6 +295,14 @@ JUCE_BEGIN_IGNORE_WARNINGS_MSVC(4996)
 #define CLAP_USE_JUCE_PARAMETER_RANGES CLAP_USE_JUCE_PARAMETER_RANGES_OFF
 #endif
 
+#define CLAP_PROCESSING_PRECISION_NATIVE 0
+#define CLAP_PROCESSING_PRECISION_FLOAT 1
+#define CLAP_PROCESSING_PRECISION_DOUBLE 2
+
+#if !defined(CLAP_PROCESSING_PRECISION)
+#define CLAP_PROCESSING_PRECISION CLAP_PROCESSING_PRECISION_NATIVE
+#endif
+
 // This is useful for debugging overrides
 // #undef CLAP_MISBEHAVIOUR_HANDLER_LEVEL
 // #define CLAP_MISBEHAVIOUR_HANDLER_LEVEL Terminate
@@ -415,6 +539,8 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
 
     bool usingLegacyParameterAPI{false};
     std::atomic<bool> callLatencyChangeOnNextActivate{false};
+    clap_juce_extensions::processing_precision processingPrecision{
+        clap_juce_extensions::processing_precision::native};
 
     ClapJuceWrapper(const clap_host *host, juce::AudioProcessor *p)
         : clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::CLAP_MISBEHAVIOUR_HANDLER_LEVEL,
@@ -491,8 +617,27 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
             processorAsClapExtensions->extensionGet = [this](const char *name) {
                 return _host.host()->get_extension(_host.host(), name);
             };
+            processorAsClapExtensions->parallelTasksSignal = [this](uint32_t numTasks) {
+                return runParallelTasks(numTasks);
+            };
+            processorAsClapExtensions->noteEndedSignal = [this](int midiChannel, int key,
+                                                                int sampleOffset) {
+                endTrackedNote(midiChannel, key, sampleOffset);
+            };
+            processorAsClapExtensions->capabilitiesChangedSignal = [this]() {
+                runOnMainThread([this] {
+                    if (isBeingDestroyed())
+                        return;
+
+                    // the new answers are picked up on the next activate
+                    if (isActive())
+                        _host.requestRestart();
+                });
+            };
         }
 
+        processingPrecision = resolveProcessingPrecision();
+
         const bool forceLegacyParamIDs = false;
 
         juceParameters.update(*processor, forceLegacyParamIDs);
@@ -522,6 +667,24 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
             clapIDByParamPtr[juceParam] = clapID;
         }
 
+        resetNoteTracking();
+
+        // room for every parameter to have a change pending, so queueing never allocates
+        const auto numParameters = (size_t)processor->getParameters().size();
+        pendingParamChanges.resize(numParameters);
+        pendingParamIndices.reserve(numParameters);
+
+        // the wrapper runs the bypass itself, which it can only do if the host can see it
+        if (auto *bypass = processor->getBypassParameter())
+        {
+            auto pf = clapIDByParamPtr.find(bypass);
+            if (pf != clapIDByParamPtr.end())
+            {
+                bypassParameter = bypass;
+                bypassClapID = pf->second;
+            }
+        }
+
 #if HAS_LINUX_FD
         juce::LinuxEventLoopInternal::registerLinuxEventLoopListener(*this);
 #endif
@@ -551,11 +714,30 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         }
 #endif
         defineAudioPorts();
+        findAudioPortsConfigs();
+        takeCapabilitySnapshot();
 
         return true;
     }
 
-    void reset() noexcept override { processor->reset(); }
+    void reset() noexcept override
+    {
+        waitForWorker();
+        processor->reset();
+        silentInputSamples = 0;
+        floatWorkerAudio.queue.clear();
+        doubleWorkerAudio.queue.clear();
+        floatBypassDelay.ring.clear();
+        doubleBypassDelay.ring.clear();
+        floatFixedBlock.clear();
+        doubleFixedBlock.clear();
+        fixedBlockMidiOutput.clear();
+        for (auto &queued : fixedBlockOutputEvents)
+            queued.clear();
+        fixedBlockPosition = 0;
+        endAllTrackedNotes(); // the processor has just dropped all its voices
+        std::fill(std::begin(mpeChannels), std::end(mpeChannels), MpeChannel{});
+    }
 
   public:
     bool implementsTimerSupport() const noexcept override { return true; }
@@ -620,6 +802,58 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
 
     clap_id idleTimer{0};
 
+    clap_juce_extensions::processing_precision resolveProcessingPrecision() const
+    {
+        using Precision = clap_juce_extensions::processing_precision;
+        auto precision = Precision::cmake_default;
+        if (processorAsClapExtensions)
+            precision = processorAsClapExtensions->getProcessingPrecision();
+
+        if (precision == Precision::cmake_default)
+        {
+#if CLAP_PROCESSING_PRECISION == CLAP_PROCESSING_PRECISION_FLOAT
+            precision = Precision::always_float;
+#elif CLAP_PROCESSING_PRECISION == CLAP_PROCESSING_PRECISION_DOUBLE
+            precision = Precision::always_double;
+#else
+            precision = Precision::native;
+#endif
+        }
+
+        if (precision == Precision::always_double &&
+            !processor->supportsDoublePrecisionProcessing())
+        {
+            jassertfalse; // can't process in double precision without processBlock(double)!
+            precision = Precision::always_float;
+        }
+
+        return precision;
+    }
+
+    /** Will we tell the host that it may hand us 64-bit buffers? */
+    bool supportsDoubleHostBuffers() const
+    {
+        if (processingPrecision == clap_juce_extensions::processing_precision::native)
+            return processor->supportsDoublePrecisionProcessing();
+        return true;
+    }
+
+    /** Does the processor run in double precision for the given host buffer type? */
+    bool processesInDouble(bool hostCalledWithDouble) const
+    {
+        switch (processingPrecision)
+        {
+        case clap_juce_extensions::processing_precision::always_float:
+            return false;
+        case clap_juce_extensions::processing_precision::always_double:
+            return true;
+        case clap_juce_extensions::processing_precision::cmake_default:
+        case clap_juce_extensions::processing_precision::native:
+            break;
+        }
+        return hostCalledWithDouble;
+    }
+
     static uint32_t generateClapIDForJuceParam(juce::AudioProcessorParameter *param)
     {
         auto juceParamID = juce::LegacyAudioParameter::getParamID(param, false);
@@ -781,9 +1015,7 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         auto id = clapIdFromParameterIndex(index);
         newValue = getUnNormalisedParameterValue(paramPtrByClapID[id], newValue);
         uiParamChangeQ.push({CLAP_EVENT_PARAM_VALUE, 0, id, newValue});
-
-        if (_host.canUseParams())
-            _host.paramsRequestFlush();
+        requestParamsFlush();
     }
 
     void audioProcessorParameterChangeGestureBegin(juce::AudioProcessor *, int index) override
@@ -792,9 +1024,7 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         auto &pbi = paramPtrByClapID[id];
         auto value = getUnNormalisedParameterValue(pbi, pbi.processorParam->getValue());
         uiParamChangeQ.push({CLAP_EVENT_PARAM_GESTURE_BEGIN, 0, id, value});
-
-        if (_host.canUseParams())
-            _host.paramsRequestFlush();
+        requestParamsFlush();
     }
 
     void audioProcessorParameterChangeGestureEnd(juce::AudioProcessor *, int index) override
@@ -803,8 +1033,16 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         auto &pbi = paramPtrByClapID[id];
         auto value = getUnNormalisedParameterValue(pbi, pbi.processorParam->getValue());
         uiParamChangeQ.push({CLAP_EVENT_PARAM_GESTURE_END, 0, id, value});
+        requestParamsFlush();
+    }
 
-        if (_host.canUseParams())
+    /*
+     * While rendering offline the host is calling process() back to back, so the queued
+     * changes go out with the next block anyway and there is no need to wake it up.
+     */
+    void requestParamsFlush()
+    {
+        if (capabilities.hostParams && !offlineRender.load(std::memory_order_relaxed))
             _host.paramsRequestFlush();
     }
 
@@ -904,21 +1142,118 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
 
     void parameterGestureChanged(int, bool) override { FIXME("parameter gesture changed"); }
 
+    /*
+     * The answers to the capability questions we need while processing. They are taken at
+     * init() and again on each activate(), so the audio thread doesn't have to ask the plugin
+     * through virtual calls on every block and event. Plugins whose answers change call
+     * clap_juce_audio_processor_capabilities::capabilitiesChanged().
+     */
+    struct CapabilitySnapshot
+    {
+        bool directProcess{false};
+        bool directParamsFlush{false};
+        bool outboundEvents{false};
+        bool sleepOnSilence{false};
+        bool constantOutputDetection{false};
+        bool workerThread{false};
+        bool doubleHostBuffers{false};
+        bool hostParams{false};
+        bool hostThreadPool{false};
+        bool parallelTasks{false};
+        bool acceptsMidi{false};
+        bool noteEndTracking{false};
+        bool noteExpressionsToMpe{false};
+
+        // bit N is set if the plugin handles core event type N with handleDirectEvent()
+        uint64_t directCoreEvents{0};
+    };
+    CapabilitySnapshot capabilities;
+
+    void takeCapabilitySnapshot()
+    {
+        auto *ext = processorAsClapExtensions;
+        CapabilitySnapshot snapshot;
+        snapshot.directProcess = ext && ext->supportsDirectProcess();
+        snapshot.directParamsFlush = ext && ext->supportsDirectParamsFlush();
+        snapshot.outboundEvents = ext && ext->supportsOutboundEvents();
+        snapshot.sleepOnSilence = ext && ext->supportsSleepOnSilence();
+        snapshot.constantOutputDetection = ext && ext->supportsConstantOutputDetection();
+        snapshot.workerThread =
+            ext && ext->supportsWorkerThreadProcessing() && !snapshot.directProcess;
+        snapshot.doubleHostBuffers = supportsDoubleHostBuffers();
+        snapshot.hostParams = _host.canUseParams();
+        // the host pool only takes requests from its own audio thread
+        snapshot.hostThreadPool = _host.canUseThreadPool() && !snapshot.workerThread;
+        snapshot.parallelTasks = ext && ext->supportsParallelTasks();
+        snapshot.acceptsMidi = processor->acceptsMidi();
+        snapshot.noteEndTracking = ext && ext->supportsNoteEndTracking();
+
+        if (ext)
+            for (uint16_t type = 0; type < 64; ++type)
+                if (ext->supportsDirectEvent(CLAP_CORE_EVENT_SPACE_ID, type))
+                    snapshot.directCoreEvents |= (uint64_t)1 << type;
+
+        // expressions the processor doesn't handle itself are translated for it, but only
+        // if it has said it takes MPE, since its notes move to the MPE member channels
+        snapshot.noteExpressionsToMpe =
+            ext && ext->supportsNoteExpressions() && snapshot.acceptsMidi &&
+            processor->supportsMPE() &&
+            ((snapshot.directCoreEvents >> CLAP_EVENT_NOTE_EXPRESSION) & 1) == 0;
+
+        capabilities = snapshot;
+    }
+
+    bool handlesEventDirectly(const clap_event_header_t *event) const
+    {
+        if (event->space_id == CLAP_CORE_EVENT_SPACE_ID && event->type < 64)
+            return ((capabilities.directCoreEvents >> event->type) & 1) != 0;
+
+        // other event spaces can't be enumerated up front, and their events are rare
+        return processorAsClapExtensions &&
+               processorAsClapExtensions->supportsDirectEvent(event->space_id, event->type);
+    }
+
     bool cacheHostCanUseThreadCheck{false};
     bool activate(double sampleRate, uint32_t minFrameCount,
                   uint32_t maxFrameCount) noexcept override
     {
         juce::ignoreUnused(minFrameCount);
 
-        if (callLatencyChangeOnNextActivate && _host.canUseLatency()) {
+        if (callLatencyChangeOnNextActivate && _host.canUseLatency())
+        {
             _host.latencyChanged();
             callLatencyChangeOnNextActivate = false;
         }
 
-        processor->setRateAndBufferSizeDetails(sampleRate, (int)maxFrameCount);
-        processor->prepareToPlay(sampleRate, (int)maxFrameCount);
-        midiBuffer.ensureSize(2048);
+        takeCapabilitySnapshot();
+
+        // the fixed block and the worker thread add to our latency
+        const auto previousWrapperLatency = getWrapperLatencySamples();
+        fixedBlockSize = resolveFixedBlockSize();
+        workerLatency = capabilities.workerThread ? (int)maxFrameCount : 0;
+        if (getWrapperLatencySamples() != previousWrapperLatency && _host.canUseLatency())
+            _host.latencyChanged();
+        const auto processBlockSize = fixedBlockSize > 0 ? fixedBlockSize : (int)maxFrameCount;
+
+        processor->setRateAndBufferSizeDetails(sampleRate, processBlockSize);
+        if (processingPrecision != clap_juce_extensions::processing_precision::native)
+            processor->setProcessingPrecision(processesInDouble(false)
+                                                  ? juce::AudioProcessor::doublePrecision
+                                                  : juce::AudioProcessor::singlePrecision);
+        midiBufferBytes = getMidiBufferReservation((int)maxFrameCount);
+        rebuildChannelRouting((int)maxFrameCount);
+        prepareFixedBlock();
+        chooseProcessLoops();
+        processor->prepareToPlay(sampleRate, processBlockSize);
+        prepareBypass(sampleRate, processBlockSize);
+        midiBuffer.ensureSize((size_t)midiBufferBytes);
         midiBuffer.clear();
+        blockEvents.reserve((size_t)juce::jmax(1024, blockEventsPeak * 2));
+        blockOutputEvents.prepare(juce::jmax((size_t)(64 * 1024), (size_t)midiBufferBytes * 8,
+                                             blockOutputEvents.peakBytes * 2));
+
+        // the resolution can change while we're active, so leave room for a sub-block per sample
+        subBlockSizes.reserve(maxFrameCount + 2);
 
         cacheHostCanUseThreadCheck = _host.canUseThreadCheck();
         if (!cacheHostCanUseThreadCheck)
@@ -926,13 +1261,32 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
             DBG("Host cannot support thread check. Using atomic guard for param feedback.");
         }
 
+        const auto tailSeconds = juce::jmax(0.0, processor->getTailLengthSeconds());
+        sleepAfterSilentSamples = std::isfinite(tailSeconds)
+                                      ? (int64_t)std::ceil(tailSeconds * sampleRate)
+                                      : std::numeric_limits<int64_t>::max();
+        if (sleepAfterSilentSamples < std::numeric_limits<int64_t>::max())
+            sleepAfterSilentSamples += getWrapperLatencySamples();
+        silentInputSamples = 0;
+
+        startWorker(sampleRate, (int)maxFrameCount);
+        parallelTaskSampleRate = sampleRate;
+        parallelTaskBlockSize = (int)maxFrameCount;
+
         if (processorAsClapProperties)
             processorAsClapProperties->is_clap_active = true;
         return true;
     }
 
+    /** The latency added by the wrapper itself, on top of the processor's. */
+    int getWrapperLatencySamples() const { return fixedBlockSize + workerLatency; }
+
     void deactivate() noexcept override
     {
+        stopWorker();
+        stopParallelTaskPool();
+        endAllTrackedNotes(); // their note ends go out with the first block after activation
+
         if (processorAsClapProperties)
             processorAsClapProperties->is_clap_active = false;
     }
@@ -960,6 +1314,100 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         juce::ignoreUnused(success);
     }
 
+    /*
+     * The channel routing plan describes where each host port channel lands in the JUCE
+     * process buffer. It only depends on the processor's bus layout, so it is rebuilt when
+     * that layout can change and process() just resolves the host pointers once per block
+     * and applies the sub-block sample offset.
+     */
+    struct ChannelRoute
+    {
+        uint32_t port{0};
+        uint32_t channel{0};
+    };
+    std::vector<ChannelRoute> inputChannelRoutes, outputChannelRoutes;
+
+    template <typename SampleType> struct ChannelPointers
+    {
+        std::vector<SampleType *> inputs, outputs; // host channels for the current block
+        std::vector<SampleType *> buffer;          // JUCE buffer channels for the sub-block
+        std::vector<uint8_t> inPlace; // does the host input already live in the output?
+        juce::AudioBuffer<SampleType> unroutedScratch;
+        juce::AudioBuffer<SampleType> inputOnlyScratch; // writable copies of the host inputs
+        juce::AudioBuffer<SampleType> aliasedInputScratch; // inputs sharing another output
+    };
+    ChannelPointers<float> floatChannels;
+    ChannelPointers<double> doubleChannels;
+    juce::AudioBuffer<float> floatConversionScratch;
+    juce::AudioBuffer<double> doubleConversionScratch;
+    juce::AudioBuffer<float> floatProcessBuffer; // what processBlock gets, see pointProcessBuffer()
+    juce::AudioBuffer<double> doubleProcessBuffer;
+
+    /*
+     * JUCE processes a bus in place if the input and output buses share the same channels of
+     * the process buffer, so that's the only case where we can offer the host an in-place pair.
+     */
+    bool canProcessBusInPlace(int busIndex) const
+    {
+        const auto *inputBus = processor->getBus(true, busIndex);
+        const auto *outputBus = processor->getBus(false, busIndex);
+        if (inputBus == nullptr || outputBus == nullptr)
+            return false;
+
+        return inputBus->getNumberOfChannels() == outputBus->getNumberOfChannels() &&
+               processor->getChannelIndexInProcessBlockBuffer(true, busIndex, 0) ==
+                   processor->getChannelIndexInProcessBlockBuffer(false, busIndex, 0);
+    }
+
+    void rebuildChannelRouting(int maxFrameCount)
+    {
+        for (auto isInput : {true, false})
+        {
+            auto &routes = isInput ? inputChannelRoutes : outputChannelRoutes;
+            routes.clear();
+            for (int bus = 0; bus < processor->getBusCount(isInput); ++bus)
+                for (int ch = 0; ch < processor->getChannelCountOfBus(isInput, bus); ++ch)
+                    routes.push_back({(uint32_t)bus, (uint32_t)ch});
+        }
+
+        const auto numInputs = inputChannelRoutes.size();
+        const auto numOutputs = outputChannelRoutes.size();
+        const auto totalChannels = juce::jmax(numInputs, numOutputs);
+
+        auto preparePointers = [&](auto &pointers) {
+            pointers.inputs.assign(numInputs, nullptr);
+            pointers.outputs.assign(numOutputs, nullptr);
+            // JUCE wants a valid channel array even if we have no channels (MIDI effects)
+            pointers.buffer.assign(juce::jmax(totalChannels, (size_t)1), nullptr);
+            pointers.inPlace.assign(juce::jmin(numInputs, numOutputs), 0);
+            pointers.unroutedScratch.setSize((int)(numInputs + numOutputs), maxFrameCount);
+            pointers.inputOnlyScratch.setSize(numInputs > numOutputs ? (int)(numInputs - numOutputs)
+                                                                     : 0,
+                                              maxFrameCount);
+            pointers.aliasedInputScratch.setSize(numOutputs > 0 ? (int)numInputs : 0,
+                                                 maxFrameCount);
+        };
+        preparePointers(floatChannels);
+        if (supportsDoubleHostBuffers())
+            preparePointers(doubleChannels);
+
+        // When the processor runs in a different precision than the host buffers,
+        // it processes in these instead.
+        floatConversionScratch.setSize(0, 0);
+        doubleConversionScratch.setSize(0, 0);
+        if (supportsDoubleHostBuffers() && !processesInDouble(true))
+            floatConversionScratch.setSize((int)totalChannels, maxFrameCount);
+        if (processesInDouble(false))
+            doubleConversionScratch.setSize((int)totalChannels, maxFrameCount);
+
+        // The process buffers own their memory at the largest size they'll be used at, so
+        // that resizing them per sub-block never reallocates (see pointProcessBuffer()).
+        floatProcessBuffer.setSize((int)totalChannels, maxFrameCount);
+        doubleProcessBuffer.setSize(0, 0);
+        if (supportsDoubleHostBuffers() || processesInDouble(false))
+            doubleProcessBuffer.setSize((int)totalChannels, maxFrameCount);
+    }
+
   protected:
     bool startProcessing() noexcept override
     {
@@ -970,6 +1418,9 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
 
     void stopProcessing() noexcept override
     {
+        // the worker may still be running the last block, and nothing else will wait for it
+        // before the host flushes parameters or resets us from this thread
+        waitForWorker();
         if (processorAsClapProperties)
             processorAsClapProperties->is_clap_processing = false;
         Plugin::stopProcessing();
@@ -985,13 +1436,9 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
     bool audioPortsInfo(uint32_t index, bool isInput,
                         clap_audio_port_info *info) const noexcept override
     {
-        // For now hardcode to stereo out. Fix this obviously.
+        // The port keeps describing the bus while port activation has it disabled
         const auto bus = processor->getBus(isInput, (int)index);
-        const auto busDefaultLayout = bus->getDefaultLayout();
-
-        // For now we only support mono or stereo buses
-        jassert(busDefaultLayout == juce::AudioChannelSet::mono() ||
-                busDefaultLayout == juce::AudioChannelSet::stereo());
+        const auto &busLayout = bus->getLastEnabledLayout();
 
         auto getPortID = [](bool isPortInput, uint32_t portIndex) {
             return (isPortInput ? 1 << 15 : 1) + portIndex;
@@ -1000,10 +1447,7 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         info->id = getPortID(isInput, index);
         strncpy(info->name, bus->getName().toRawUTF8(), sizeof(info->name));
 
-        bool couldBeMain = true;
-        if (isInput && processorAsClapExtensions)
-            couldBeMain = processorAsClapExtensions->isInputMain((int)index);
-        if (index == 0 && couldBeMain)
+        if (isMainPort(isInput, index))
         {
             info->flags = CLAP_AUDIO_PORT_IS_MAIN;
         }
@@ -1012,47 +1456,329 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
             info->flags = 0;
         }
 
-        if (processor->supportsDoublePrecisionProcessing())
+        if (supportsDoubleHostBuffers())
         {
+            // in "always float" mode we'll take doubles from a 64-bit host,
+            // but we'd rather get floats
             info->flags |= CLAP_AUDIO_PORT_SUPPORTS_64BITS;
-            info->flags |= CLAP_AUDIO_PORT_PREFERS_64BITS;
+            if (processesInDouble(true))
+                info->flags |= CLAP_AUDIO_PORT_PREFERS_64BITS;
             info->flags |= CLAP_AUDIO_PORT_REQUIRES_COMMON_SAMPLE_SIZE;
         }
 
-        if (processor->getBus(!isInput, (int)index) != nullptr)
+        if (canProcessBusInPlace((int)index))
         {
-            // this bus has a corresponding bus on the other side, so it can do in-place processing
+            // this bus has a matching bus on the other side, so it can do in-place processing
             info->in_place_pair = getPortID(!isInput, index);
         }
         else
         {
-            // this bus has no corresponding bus, so it can't do in-place processing
+            // this bus has no matching bus, so it can't do in-place processing
             info->in_place_pair = CLAP_INVALID_ID;
         }
 
-        info->channel_count = (uint32_t)busDefaultLayout.size();
+        info->channel_count = (uint32_t)busLayout.size();
+        info->port_type = getPortType(busLayout); // nullptr for discrete channels
 
-        if (busDefaultLayout == juce::AudioChannelSet::mono())
-            info->port_type = CLAP_PORT_MONO;
-        else if (busDefaultLayout == juce::AudioChannelSet::stereo())
-            info->port_type = CLAP_PORT_STEREO;
-        else
-            jassertfalse; // @TODO: implement CLAP_PORT_SURROUND and CLAP_PORT_AMBISONIC through
-                          // extensions
+        return true;
+    }
+
+    bool isMainPort(bool isInput, uint32_t index) const
+    {
+        bool couldBeMain = true;
+        if (isInput && processorAsClapExtensions)
+            couldBeMain = processorAsClapExtensions->isInputMain((int)index);
+        return index == 0 && couldBeMain;
+    }
+
+    static const char *getPortType(const juce::AudioChannelSet &layout)
+    {
+        if (layout == juce::AudioChannelSet::mono())
+            return CLAP_PORT_MONO;
+        if (layout == juce::AudioChannelSet::stereo())
+            return CLAP_PORT_STEREO;
+        if (layout.getAmbisonicOrder() >= 0)
+            return CLAP_PORT_AMBISONIC;
+        if (getSurroundChannelMask(layout) != 0)
+            return CLAP_PORT_SURROUND;
+        return nullptr;
+    }
+
+    /*
+     * Surround and ambisonic ports. The channel maps we report are in JUCE's own channel
+     * order, so channels never need reordering and wide buses go through the same routing
+     * plan, pointing straight at the host's buffers, as stereo ones do. JUCE's side and rear
+     * pairs are CLAP's side and back pairs, and its plain surround pair is the back pair
+     * (as in 5.1), unless the layout has a rear pair as well, which makes it the side pair.
+     */
+    struct SurroundMapping
+    {
+        juce::AudioChannelSet::ChannelType type;
+        int position;
+    };
+    static const std::vector<SurroundMapping> &getSurroundMappings()
+    {
+        using Set = juce::AudioChannelSet;
+        static const std::vector<SurroundMapping> mappings{
+            {Set::left, CLAP_SURROUND_FL},
+            {Set::right, CLAP_SURROUND_FR},
+            {Set::centre, CLAP_SURROUND_FC},
+            {Set::LFE, CLAP_SURROUND_LFE},
+            {Set::leftSurround, CLAP_SURROUND_BL},
+            {Set::rightSurround, CLAP_SURROUND_BR},
+            {Set::leftSurroundRear, CLAP_SURROUND_BL},
+            {Set::rightSurroundRear, CLAP_SURROUND_BR},
+            {Set::leftCentre, CLAP_SURROUND_FLC},
+            {Set::rightCentre, CLAP_SURROUND_FRC},
+            {Set::centreSurround, CLAP_SURROUND_BC},
+            {Set::leftSurroundSide, CLAP_SURROUND_SL},
+            {Set::rightSurroundSide, CLAP_SURROUND_SR},
+            {Set::topMiddle, CLAP_SURROUND_TC},
+            {Set::topFrontLeft, CLAP_SURROUND_TFL},
+            {Set::topFrontCentre, CLAP_SURROUND_TFC},
+            {Set::topFrontRight, CLAP_SURROUND_TFR},
+            {Set::topRearLeft, CLAP_SURROUND_TBL},
+            {Set::topRearCentre, CLAP_SURROUND_TBC},
+            {Set::topRearRight, CLAP_SURROUND_TBR},
+        };
+        return mappings;
+    }
+
+    static int getSurroundPosition(const juce::AudioChannelSet &layout,
+                                   juce::AudioChannelSet::ChannelType type)
+    {
+        using Set = juce::AudioChannelSet;
+        if (type == Set::leftSurround && layout.getChannelIndexForType(Set::leftSurroundRear) >= 0)
+            return CLAP_SURROUND_SL;
+        if (type == Set::rightSurround &&
+            layout.getChannelIndexForType(Set::rightSurroundRear) >= 0)
+            return CLAP_SURROUND_SR;
+
+        for (const auto &mapping : getSurroundMappings())
+            if (mapping.type == type)
+                return mapping.position;
+        return -1;
+    }
+
+    /** The CLAP channel mask for a layout, or 0 if CLAP can't describe it. */
+    static uint64_t getSurroundChannelMask(const juce::AudioChannelSet &layout)
+    {
+        uint64_t mask = 0;
+        for (auto type : layout.getChannelTypes())
+        {
+            const auto position = getSurroundPosition(layout, type);
+            if (position < 0 || (mask & ((uint64_t)1 << position)) != 0)
+                return 0;
+            mask |= (uint64_t)1 << position;
+        }
+        return mask;
+    }
+
+    bool implementsSurround() const noexcept override { return true; }
+    bool surroundIsChannelMaskSupported(uint64_t channelMask) const noexcept override
+    {
+        // JUCE calls the back pair "surround" in 5.1 but "surround rear" next to side pairs
+        const auto hasSides = (channelMask & ((uint64_t)1 << CLAP_SURROUND_SL)) != 0;
+
+        juce::AudioChannelSet layout;
+        for (int position = 0; position < 64; ++position)
+        {
+            if ((channelMask & ((uint64_t)1 << position)) == 0)
+                continue;
+
+            auto type = juce::AudioChannelSet::unknown;
+            for (const auto &mapping : getSurroundMappings())
+            {
+                if (mapping.position == position)
+                {
+                    type = mapping.type;
+                    break;
+                }
+            }
+            if (hasSides && position == CLAP_SURROUND_BL)
+                type = juce::AudioChannelSet::leftSurroundRear;
+            if (hasSides && position == CLAP_SURROUND_BR)
+                type = juce::AudioChannelSet::rightSurroundRear;
+
+            if (type == juce::AudioChannelSet::unknown)
+                return false;
+            layout.addChannel(type);
+        }
+        return isMainLayoutSupported(layout);
+    }
+    uint32_t surroundGetChannelMap(bool isInput, uint32_t portIndex, uint8_t *channelMap,
+                                   uint32_t channelMapCapacity) const noexcept override
+    {
+        const auto *bus = processor->getBus(isInput, (int)portIndex);
+        if (bus == nullptr || getSurroundChannelMask(bus->getLastEnabledLayout()) == 0)
+            return 0;
+
+        const auto &layout = bus->getLastEnabledLayout();
+        uint32_t count = 0;
+        for (auto type : layout.getChannelTypes())
+            if (count < channelMapCapacity)
+                channelMap[count++] = (uint8_t)getSurroundPosition(layout, type);
+        return count;
+    }
+
+    bool implementsAmbisonic() const noexcept override { return true; }
+    bool ambisonicIsConfigSupported(const clap_ambisonic_config *config) const noexcept override
+    {
+        // JUCE's ambisonic channel sets are ACN ordered and SN3D normalised
+        return config->ordering == CLAP_AMBISONIC_ORDERING_ACN &&
+               config->normalization == CLAP_AMBISONIC_NORMALIZATION_SN3D;
+    }
+    bool ambisonicGetConfig(bool isInput, uint32_t portIndex,
+                            clap_ambisonic_config *config) const noexcept override
+    {
+        const auto *bus = processor->getBus(isInput, (int)portIndex);
+        if (bus == nullptr || bus->getLastEnabledLayout().getAmbisonicOrder() < 0)
+            return false;
 
+        config->ordering = CLAP_AMBISONIC_ORDERING_ACN;
+        config->normalization = CLAP_AMBISONIC_NORMALIZATION_SN3D;
         return true;
     }
+
+    /** Would the processor take this layout on its main buses? */
+    bool isMainLayoutSupported(const juce::AudioChannelSet &layout) const
+    {
+        auto buses = processor->getBusesLayout();
+        if (!buses.outputBuses.isEmpty())
+            buses.getChannelSet(false, 0) = layout;
+        if (!buses.inputBuses.isEmpty() && isMainPort(true, 0))
+            buses.getChannelSet(true, 0) = layout;
+        return processor->checkBusesLayoutSupported(buses);
+    }
+
+    /*
+     * The audio port configurations are the mono and stereo combinations of the main buses
+     * which the processor accepts, and then the surround and ambisonic layouts it accepts on
+     * both of them at once, found by probing isBusesLayoutSupported() at init. Any other
+     * buses keep their default layout (use port activation to switch those on and off).
+     * The host can switch between them while we're deactivated, without a new instance.
+     */
+    struct AudioPortsConfig
+    {
+        juce::AudioProcessor::BusesLayout layout;
+        juce::String name;
+    };
+    std::vector<AudioPortsConfig> audioPortsConfigs;
+
+    void findAudioPortsConfigs()
+    {
+        audioPortsConfigs.clear();
+
+        const auto hasMainInput = processor->getBusCount(true) > 0 && isMainPort(true, 0);
+        const auto hasMainOutput = processor->getBusCount(false) > 0;
+        if (!hasMainInput && !hasMainOutput)
+            return;
+
+        const auto defaultLayout = processor->getBusesLayout();
+        auto addConfig = [&](const juce::AudioChannelSet &inputLayout,
+                             const juce::AudioChannelSet &outputLayout) {
+            auto layout = defaultLayout;
+            juce::String name;
+            if (hasMainInput)
+            {
+                layout.getChannelSet(true, 0) = inputLayout;
+                name << inputLayout.getDescription() << " In";
+            }
+            if (hasMainOutput)
+            {
+                layout.getChannelSet(false, 0) = outputLayout;
+                name << (name.isEmpty() ? "" : ", ") << outputLayout.getDescription() << " Out";
+            }
+
+            const auto alreadyFound =
+                std::any_of(audioPortsConfigs.begin(), audioPortsConfigs.end(),
+                            [&layout](const auto &config) { return config.layout == layout; });
+            if (!alreadyFound && processor->checkBusesLayoutSupported(layout))
+                audioPortsConfigs.push_back({layout, name});
+        };
+
+        using Set = juce::AudioChannelSet;
+        for (const auto &inputLayout : {Set::mono(), Set::stereo()})
+            for (const auto &outputLayout : {Set::mono(), Set::stereo()})
+                addConfig(inputLayout, outputLayout);
+
+        for (const auto &layout :
+             {Set::createLCR(), Set::quadraphonic(), Set::create5point0(), Set::create5point1(),
+              Set::create6point0(), Set::create6point1(), Set::create7point0(),
+              Set::create7point1(), Set::create7point0point2(), Set::create7point1point2(),
+              Set::create7point0point4(), Set::create7point1point4(), Set::ambisonic(1),
+              Set::ambisonic(2), Set::ambisonic(3)})
+            addConfig(layout, layout);
+    }
+
+    bool implementsAudioPortsConfig() const noexcept override { return true; }
     uint32_t audioPortsConfigCount() const noexcept override
     {
-        DBG("audioPortsConfigCount CALLED - returning 0");
-        return 0;
+        return (uint32_t)audioPortsConfigs.size();
+    }
+    bool audioPortsGetConfig(uint32_t index,
+                             clap_audio_ports_config *config) const noexcept override
+    {
+        if (index >= audioPortsConfigs.size())
+            return false;
+
+        const auto &layout = audioPortsConfigs[index].layout;
+        config->id = index;
+        strncpy(config->name, audioPortsConfigs[index].name.toRawUTF8(), sizeof(config->name));
+        config->input_port_count = (uint32_t)layout.inputBuses.size();
+        config->output_port_count = (uint32_t)layout.outputBuses.size();
+
+        config->has_main_input = !layout.inputBuses.isEmpty() && isMainPort(true, 0);
+        config->main_input_channel_count = 0;
+        config->main_input_port_type = nullptr;
+        if (config->has_main_input)
+        {
+            config->main_input_channel_count = (uint32_t)layout.getChannelSet(true, 0).size();
+            config->main_input_port_type = getPortType(layout.getChannelSet(true, 0));
+        }
+
+        config->has_main_output = !layout.outputBuses.isEmpty();
+        config->main_output_channel_count = 0;
+        config->main_output_port_type = nullptr;
+        if (config->has_main_output)
+        {
+            config->main_output_channel_count = (uint32_t)layout.getChannelSet(false, 0).size();
+            config->main_output_port_type = getPortType(layout.getChannelSet(false, 0));
+        }
+        return true;
     }
-    bool audioPortsGetConfig(uint32_t /*index*/,
-                             clap_audio_ports_config * /*config*/) const noexcept override
+    bool audioPortsSetConfig(clap_id configId) noexcept override
+    {
+        // the routing plan follows the new layout when we're next activated
+        if (isActive() || configId >= audioPortsConfigs.size())
+            return false;
+        return processor->setBusesLayout(audioPortsConfigs[configId].layout);
+    }
+
+    /*
+     * Port activation maps onto JUCE's bus enablement. A disabled bus has no channels in the
+     * processor's layout, so it drops out of the routing plan at the next activate and we
+     * neither copy nor render it. Changing the layout means preparing the processor again,
+     * so this isn't allowed while processing.
+     */
+    bool implementsAudioPortsActivation() const noexcept override { return true; }
+    bool audioPortsActivationCanActivateWhileProcessing() const noexcept override
     {
         return false;
     }
-    bool audioPortsSetConfig(clap_id /*configId*/) noexcept override { return false; }
+    bool audioPortsActivationSetActive(bool isInput, uint32_t portIndex, bool shouldBeActive,
+                                       uint32_t /*sampleSize*/) noexcept override
+    {
+        if (isActive())
+            return false;
+
+        auto *bus = processor->getBus(isInput, (int)portIndex);
+        if (bus == nullptr)
+            return false;
+
+        // the processor gets the final say through isBusesLayoutSupported()
+        return bus->enable(shouldBeActive);
+    }
 
     bool implementsNotePorts() const noexcept override { return true; }
     uint32_t notePortsCount(bool is_input) const noexcept override
@@ -1135,23 +1861,229 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         return Plugin::voiceInfoGet(info);
     }
 
-    bool implementsNoteName() const noexcept override
+    /*
+     * Parallel tasks. The plugin calls submitParallelTasks() from processBlock and the tasks
+     * go to the host's thread pool if it has one. If it hasn't, or it turns the request down,
+     * they go to a pool of threads of our own, and the calling thread joins in. That pool is
+     * only started once it's needed: the batch which finds it missing runs on the calling
+     * thread, and asks for a main thread callback to start the pool for the next one.
+     */
+    bool implementsThreadPool() const noexcept override
     {
-#if JUCE_VERSION < 0x080005
         if (processorAsClapExtensions)
-            return processorAsClapExtensions->supportsNoteName();
-#endif
-
-        return true;
+            return processorAsClapExtensions->supportsParallelTasks();
+        return false;
     }
 
-    uint32_t noteNameCount() noexcept override
+    void threadPoolExec(uint32_t taskIndex) noexcept override
     {
-        if (processorAsClapExtensions && processorAsClapExtensions->supportsNoteName())
-            return processorAsClapExtensions->noteNameCount();
-
-#if JUCE_VERSION >= 0x080005
-        noteNameInfoCached.clear();
+        processorAsClapExtensions->parallelTaskExecute(taskIndex);
+    }
+
+    /*
+     * A lock-free work-stealing pool. Each thread taking part in a batch, the calling thread
+     * included, starts with its own contiguous run of the task indices. It takes tasks from
+     * the front of its run, and once that's empty steals them one at a time from the back of
+     * the others' runs. A run is a single atomic (begin << 32 | end), so taking and stealing
+     * are both a compare and swap on it. The calling thread spins, then yields, while the last
+     * stolen tasks finish, and only blocks if they're still going after that.
+     */
+    class WorkStealingTaskPool
+    {
+      public:
+        WorkStealingTaskPool(clap_juce_extensions::clap_juce_audio_processor_capabilities &p,
+                             int numThreads, double sampleRate, int blockSize)
+            : plugin(p), runs((size_t)numThreads + 1)
+        {
+            for (int i = 0; i < numThreads; ++i)
+            {
+                helpers.push_back(std::make_unique<Helper>(*this, (size_t)i + 1));
+                startRealtimeThread(*helpers.back(), sampleRate, blockSize);
+            }
+        }
+
+        ~WorkStealingTaskPool()
+        {
+            for (auto &helper : helpers)
+            {
+                helper->signalThreadShouldExit();
+                helper->wake.signal();
+            }
+            for (auto &helper : helpers)
+                helper->stopThread(1000);
+        }
+
+        void run(uint32_t numTasks)
+        {
+            // Every run is handed out before any helper is woken. The last batch finished
+            // all of its tasks before returning, so any helper still looking at the runs only
+            // finds empty ones, or tasks from this batch, which it's welcome to.
+            const auto numThreads = (uint32_t)juce::jmin(runs.size(), (size_t)numTasks);
+            remaining.store(numTasks, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < (uint32_t)runs.size(); ++i)
+            {
+                const auto begin = i < numThreads ? (uint64_t)numTasks * i / numThreads : 0;
+                const auto end = i < numThreads ? (uint64_t)numTasks * (i + 1) / numThreads : 0;
+                runs[i].range.store((begin << 32) | end, std::memory_order_release);
+            }
+
+            for (uint32_t i = 1; i < numThreads; ++i)
+                helpers[i - 1]->wake.signal();
+
+            runTasks(0);
+            for (int spins = 0; remaining.load(std::memory_order_acquire) > 0; ++spins)
+            {
+                if (spins < 1000)
+                    continue;
+                if (spins < 1100)
+                    std::this_thread::yield();
+                else
+                    done.wait(-1);
+            }
+        }
+
+      private:
+        struct Helper : juce::Thread
+        {
+            Helper(WorkStealingTaskPool &p, size_t index)
+                : juce::Thread("CLAP parallel tasks"), pool(p), runIndex(index)
+            {
+            }
+
+            void run() override
+            {
+                // the destructor signals wake after asking us to exit, so no need to poll
+                while (!threadShouldExit())
+                    if (wake.wait(-1) && !threadShouldExit())
+                        pool.runTasks(runIndex);
+            }
+
+            juce::WaitableEvent wake;
+            WorkStealingTaskPool &pool;
+            size_t runIndex;
+        };
+
+        struct TaskRun
+        {
+            std::atomic<uint64_t> range{0}; // begin << 32 | end
+            char padding[64 - sizeof(std::atomic<uint64_t>)]; // one cache line each
+        };
+
+        /** Takes a task from the front of the run, or steals one from the back. */
+        static bool takeTask(TaskRun &run, bool fromFront, uint32_t &task)
+        {
+            auto range = run.range.load(std::memory_order_acquire);
+            for (;;)
+            {
+                const auto begin = (uint32_t)(range >> 32);
+                const auto end = (uint32_t)range;
+                if (begin >= end)
+                    return false;
+
+                const auto taken = fromFront ? ((uint64_t)(begin + 1) << 32) | end
+                                             : ((uint64_t)begin << 32) | (end - 1);
+                if (run.range.compare_exchange_weak(range, taken, std::memory_order_acq_rel))
+                {
+                    task = fromFront ? begin : end - 1;
+                    return true;
+                }
+            }
+        }
+
+        /** Runs this thread's own tasks, then steals from the others until none are left. */
+        void runTasks(size_t self)
+        {
+            uint32_t task = 0;
+            for (;;)
+            {
+                auto found = takeTask(runs[self], true, task);
+                for (size_t i = 1; !found && i < runs.size(); ++i)
+                    found = takeTask(runs[(self + i) % runs.size()], false, task);
+                if (!found)
+                    return;
+
+                plugin.parallelTaskExecute(task);
+                if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    done.signal();
+            }
+        }
+
+        clap_juce_extensions::clap_juce_audio_processor_capabilities &plugin;
+        std::vector<std::unique_ptr<Helper>> helpers;
+        std::vector<TaskRun> runs; // the calling thread's first, then one per helper
+        std::atomic<uint32_t> remaining{0};
+        juce::WaitableEvent done;
+    };
+    // owned on the main thread, and published to the audio thread once its helpers are running
+    std::unique_ptr<WorkStealingTaskPool> parallelTaskPool;
+    std::atomic<WorkStealingTaskPool *> activeParallelTaskPool{nullptr};
+    std::atomic<bool> parallelTaskPoolWanted{false};
+    double parallelTaskSampleRate{0.0};
+    int parallelTaskBlockSize{0};
+
+    void startParallelTaskPool()
+    {
+        if (parallelTaskPool != nullptr || !isActive() || !capabilities.parallelTasks)
+            return;
+
+        const auto numThreads = juce::jlimit(0, 15, juce::SystemStats::getNumCpus() - 1);
+        if (numThreads == 0)
+            return;
+
+        parallelTaskPool = std::make_unique<WorkStealingTaskPool>(
+            *processorAsClapExtensions, numThreads, parallelTaskSampleRate, parallelTaskBlockSize);
+        activeParallelTaskPool.store(parallelTaskPool.get(), std::memory_order_release);
+    }
+
+    void stopParallelTaskPool()
+    {
+        activeParallelTaskPool.store(nullptr, std::memory_order_release);
+        parallelTaskPoolWanted.store(false, std::memory_order_relaxed);
+        parallelTaskPool.reset();
+    }
+
+    bool runParallelTasks(uint32_t numTasks)
+    {
+        if (numTasks == 0)
+            return true;
+
+        if (capabilities.hostThreadPool && _host.threadPoolRequestExec(numTasks))
+            return true;
+
+        // the signal is always connected, so processors which never opted in get no threads
+        if (numTasks > 1 && capabilities.parallelTasks)
+        {
+            if (auto *pool = activeParallelTaskPool.load(std::memory_order_acquire))
+            {
+                pool->run(numTasks);
+                return true;
+            }
+            if (!parallelTaskPoolWanted.exchange(true, std::memory_order_relaxed))
+                _host.requestCallback();
+        }
+
+        for (uint32_t i = 0; i < numTasks; ++i)
+            processorAsClapExtensions->parallelTaskExecute(i);
+        return true;
+    }
+
+    bool implementsNoteName() const noexcept override
+    {
+#if JUCE_VERSION < 0x080005
+        if (processorAsClapExtensions)
+            return processorAsClapExtensions->supportsNoteName();
+#endif
+
+        return true;
+    }
+
+    uint32_t noteNameCount() noexcept override
+    {
+        if (processorAsClapExtensions && processorAsClapExtensions->supportsNoteName())
+            return processorAsClapExtensions->noteNameCount();
+
+#if JUCE_VERSION >= 0x080005
+        noteNameInfoCached.clear();
 
         // The JUCE docs say that plugins need to be able to handle
         // note name requests for notes above 127, but CLAP only supports
@@ -1404,6 +2336,9 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         if (paramVariant.processorParam->isAutomatable())
             info->flags = info->flags | CLAP_PARAM_IS_AUTOMATABLE;
 
+        if (paramVariant.processorParam == bypassParameter)
+            info->flags = info->flags | CLAP_PARAM_IS_BYPASS;
+
         if (paramVariant.processorParam->isBoolean())
         {
             // This condition used to say || paramVariant.processorParam->isDiscrete())
@@ -1502,6 +2437,420 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         paramSetValueAndNotifyIfChanged(*jp, (float)nf);
     }
 
+    /*
+     * Note end tracking. Note ons from the host are kept in a fixed pool, on a list for their
+     * MIDI channel and key, and when the processor reports that a voice has finished, the
+     * oldest note on that channel and key is ended with CLAP_EVENT_NOTE_END. Reports come in
+     * relative to the processBlock call, so the process loops tell us where that call starts
+     * in the host block. The note ends go into our own output list for the block (or the
+     * worker's, which is delayed along with its audio), so they are sorted in with the rest of
+     * the block's output rather than reaching the host out of order. Finding a note is a lookup
+     * in the per key table, and nothing is allocated after the constructor.
+     *
+     * The host keeps a voice for every note until it gets its note end, so every note gets
+     * one. Notes reported outside a block, and every note still held when we're reset or
+     * deactivated, have their note ends queued for the start of the next block. A choked note
+     * is ended straight away, and stays on its list marked as choked, so that the processor's
+     * report of that voice ending doesn't end the next note on the same key instead.
+     */
+    struct TrackedNote
+    {
+        int32_t noteId{-1};
+        int16_t port{0};
+        int next{-1};
+        bool choked{false};
+    };
+    struct PendingNoteEnd
+    {
+        int32_t noteId;
+        int16_t port, channel, key;
+    };
+    static constexpr int maxTrackedNotes = 4096;
+    static constexpr int numNoteSlots = 16 * 128;
+    std::vector<TrackedNote> trackedNotes;
+    std::vector<int> trackedNoteHeads, trackedNoteTails; // per channel and key, oldest first
+    int freeTrackedNote{-1};
+    std::vector<PendingNoteEnd> pendingNoteEnds; // reserved for every tracked note
+
+    struct EventList;
+    EventList *noteEndEvents{nullptr}; // only set inside the process loops
+    juce::Thread::ThreadID noteEndThread{nullptr};
+    int noteEndOffset{0}, noteEndBlockLength{0};
+
+    void resetNoteTracking()
+    {
+        trackedNotes.resize(maxTrackedNotes);
+        for (int i = 0; i < maxTrackedNotes; ++i)
+            trackedNotes[(size_t)i] = {-1, 0, i + 1 < maxTrackedNotes ? i + 1 : -1};
+        freeTrackedNote = 0;
+        trackedNoteHeads.assign(numNoteSlots, -1);
+        trackedNoteTails.assign(numNoteSlots, -1);
+        pendingNoteEnds.reserve(maxTrackedNotes);
+    }
+
+    /** Queues a note end for every note we're tracking, and forgets them all. */
+    void endAllTrackedNotes()
+    {
+        for (int slot = 0; slot < numNoteSlots; ++slot)
+        {
+            for (auto index = trackedNoteHeads[(size_t)slot]; index >= 0;)
+            {
+                const auto &tracked = trackedNotes[(size_t)index];
+                if (!tracked.choked)
+                    queueNoteEnd(tracked, slot / 128, slot % 128);
+                index = tracked.next;
+            }
+        }
+        resetNoteTracking();
+    }
+
+    void queueNoteEnd(const TrackedNote &tracked, int channel, int key)
+    {
+        if (pendingNoteEnds.size() == pendingNoteEnds.capacity())
+        {
+            jassertfalse; // more ends than there can be tracked notes
+            return;
+        }
+        pendingNoteEnds.push_back(
+            {tracked.noteId, tracked.port, (int16_t)channel, (int16_t)key});
+    }
+
+    /** Sends the note ends queued since the last block at the start of this one. */
+    void sendPendingNoteEnds(EventList &ov)
+    {
+        for (const auto &pending : pendingNoteEnds)
+            pushNoteEnd(ov, pending.noteId, pending.port, pending.channel, pending.key, 0);
+        pendingNoteEnds.clear();
+    }
+
+    static void pushNoteEnd(EventList &ov, int32_t noteId, int16_t port, int channel, int key,
+                            uint32_t time)
+    {
+        auto evt = clap_event_note();
+        evt.header.size = sizeof(clap_event_note);
+        evt.header.type = (uint16_t)CLAP_EVENT_NOTE_END;
+        evt.header.time = time;
+        evt.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+        evt.header.flags = 0;
+        evt.note_id = noteId;
+        evt.port_index = port;
+        evt.channel = (int16_t)channel;
+        evt.key = (int16_t)key;
+        evt.velocity = 0.0;
+        ov.push(reinterpret_cast<const clap_event_header *>(&evt));
+    }
+
+    /** Ends the tracked notes a choke matches, -1 matching any channel, key or note ID. */
+    void endChokedNotes(int channel, int key, int32_t noteId, uint32_t time)
+    {
+        if (!capabilities.noteEndTracking || channel >= 16 || key >= 128)
+            return;
+
+        for (auto ch = juce::jmax(0, channel); ch < (channel < 0 ? 16 : channel + 1); ++ch)
+        {
+            for (auto k = juce::jmax(0, key); k < (key < 0 ? 128 : key + 1); ++k)
+            {
+                const auto slot = (size_t)getNoteSlot(ch, k);
+                for (auto index = trackedNoteHeads[slot]; index >= 0;)
+                {
+                    auto &tracked = trackedNotes[(size_t)index];
+                    index = tracked.next;
+                    if (tracked.choked || (noteId >= 0 && tracked.noteId != noteId))
+                        continue;
+
+                    tracked.choked = true;
+                    if (noteEndEvents != nullptr)
+                        pushNoteEnd(*noteEndEvents, tracked.noteId, tracked.port, ch, k, time);
+                    else
+                        queueNoteEnd(tracked, ch, k);
+                }
+            }
+        }
+    }
+
+    static int getNoteSlot(int channel, int key) { return channel * 128 + key; }
+
+    void trackNoteOn(int32_t noteId, int16_t port, int channel, int key)
+    {
+        if (!juce::isPositiveAndBelow(channel, 16) || !juce::isPositiveAndBelow(key, 128))
+            return;
+        if (freeTrackedNote < 0)
+        {
+            jassertfalse; // too many notes the processor hasn't reported as ended
+            return;
+        }
+
+        const auto index = freeTrackedNote;
+        auto &tracked = trackedNotes[(size_t)index];
+        freeTrackedNote = tracked.next;
+        tracked = {noteId, port, -1, false};
+
+        const auto slot = (size_t)getNoteSlot(channel, key);
+        if (trackedNoteTails[slot] >= 0)
+            trackedNotes[(size_t)trackedNoteTails[slot]].next = index;
+        else
+            trackedNoteHeads[slot] = index;
+        trackedNoteTails[slot] = index;
+    }
+
+    void beginNoteEndOutput(EventList &ov)
+    {
+        noteEndEvents = capabilities.noteEndTracking ? &ov : nullptr;
+        noteEndThread = juce::Thread::getCurrentThreadId();
+        noteEndOffset = 0;
+        noteEndBlockLength = 0;
+    }
+
+    /** Where the loop running on this thread collects its output, before the fixed block. */
+    EventList &getLoopOutputEvents()
+    {
+        return processingWorker != nullptr ? workerOutputEvents : blockOutputEvents;
+    }
+
+    void endTrackedNote(int midiChannel, int key, int sampleOffset)
+    {
+        // The note list isn't locked, so this has to come from processBlock's own thread. Voices
+        // rendered by parallel tasks should report their ends once the tasks have joined.
+        jassert(noteEndEvents == nullptr || juce::Thread::getCurrentThreadId() == noteEndThread);
+
+        const auto channel = midiChannel - 1;
+        if (!juce::isPositiveAndBelow(channel, 16) || !juce::isPositiveAndBelow(key, 128))
+            return;
+
+        const auto slot = (size_t)getNoteSlot(channel, key);
+        const auto index = trackedNoteHeads[slot];
+        if (index < 0)
+            return; // not a note the host started, or it has already been ended
+
+        auto &tracked = trackedNotes[(size_t)index];
+        trackedNoteHeads[slot] = tracked.next;
+        if (tracked.next < 0)
+            trackedNoteTails[slot] = -1;
+        tracked.next = freeTrackedNote;
+        freeTrackedNote = index;
+
+        if (tracked.choked)
+            return; // the host has had this one's note end already
+        if (noteEndEvents == nullptr)
+        {
+            // reported from outside processBlock, so it goes out with the next block
+            queueNoteEnd(tracked, channel, key);
+            return;
+        }
+
+        const auto lastSample = juce::jmax(0, noteEndBlockLength - 1);
+        pushNoteEnd(*noteEndEvents, tracked.noteId, tracked.port, channel, key,
+                    (uint32_t)(noteEndOffset + juce::jlimit(0, lastSample, sampleOffset)));
+    }
+
+    /*
+     * Note expressions as MPE. When the processor takes note expressions and MPE but doesn't
+     * handle expressions itself, each note from the host is given a member channel of an MPE
+     * lower zone (MIDI channels 2-16) when it starts, and its expressions follow it there:
+     * tuning as pitch bend over MPE's default 48 semitone range, pressure as channel pressure,
+     * brightness as CC74, volume as CC7 (with unity gain at 100) and pan as CC10. Channels are
+     * handed out in rotation, so a released note keeps its channel, and its release, for as
+     * long as possible. Note offs and chokes find the note's channel the same way its
+     * expressions do. A note which has lost its channel to a newer one was ended when that
+     * happened, so nothing more is sent for it.
+     */
+    struct MpeChannel
+    {
+        int32_t noteId{-1};
+        int hostChannel{-1}, key{-1};
+        bool active{false};
+    };
+    static constexpr int numMpeMemberChannels = 15;
+    static constexpr double mpePitchBendRange = 48.0;
+    MpeChannel mpeChannels[numMpeMemberChannels];
+    int nextMpeChannel{0};
+
+    void addMidiMessage(int status, int data1, int data2, int time)
+    {
+        const uint8_t data[3] = {(uint8_t)status, (uint8_t)(data1 & 0x7f), (uint8_t)(data2 & 0x7f)};
+        midiBuffer.addEvent(data, 3, time);
+    }
+
+    int findMpeChannel(int32_t noteId, int hostChannel, int key) const
+    {
+        for (int i = 0; i < numMpeMemberChannels; ++i)
+        {
+            const auto &mpe = mpeChannels[i];
+            if (!mpe.active)
+                continue;
+            if (noteId >= 0 && mpe.noteId >= 0 ? mpe.noteId == noteId
+                                                : mpe.hostChannel == hostChannel && mpe.key == key)
+                return i;
+        }
+        return -1;
+    }
+
+    /** Gives the note a member channel and returns it. */
+    int startMpeNote(const clap_event_note *note, int time)
+    {
+        auto index = nextMpeChannel;
+        for (int i = 0; i < numMpeMemberChannels; ++i)
+        {
+            const auto candidate = (nextMpeChannel + i) % numMpeMemberChannels;
+            if (!mpeChannels[candidate].active)
+            {
+                index = candidate;
+                break;
+            }
+        }
+        nextMpeChannel = (index + 1) % numMpeMemberChannels;
+
+        auto &mpe = mpeChannels[index];
+        const auto channel = index + 1; // zero based, so after the zone's master channel
+        if (mpe.active) // all 15 are sounding, so this one makes way for the new note
+            addMidiMessage(0x80 | channel, mpe.key, 0, time);
+        mpe = {note->note_id, note->channel, note->key, true};
+
+        // MPE notes start from neutral expression, whatever the channel's last note did
+        addMidiMessage(0xe0 | channel, 0x00, 0x40, time);
+        addMidiMessage(0xd0 | channel, 0, 0, time);
+        addMidiMessage(0xb0 | channel, 74, 64, time);
+        return channel;
+    }
+
+    /** Frees the note's member channel and returns it, or -1 if it hasn't one. */
+    int stopMpeNote(const clap_event_note *note)
+    {
+        const auto index = findMpeChannel(note->note_id, note->channel, note->key);
+        if (index < 0)
+            return -1;
+
+        mpeChannels[index].active = false;
+        return index + 1;
+    }
+
+    /*
+     * MIDI has no way to choke a single note, so a choked note gets a note off, and a choke
+     * of a whole channel, or of everything, gets an all sound off. With MPE every matching
+     * note has a member channel of its own, so those just get a note off each. Either way
+     * the choked notes are ended for the host there and then.
+     */
+    void chokeNotes(const clap_event_note *note, int time)
+    {
+        if (capabilities.noteExpressionsToMpe)
+        {
+            for (int i = 0; i < numMpeMemberChannels; ++i)
+            {
+                auto &mpe = mpeChannels[i];
+                const auto matches =
+                    note->note_id >= 0 && mpe.noteId >= 0
+                        ? mpe.noteId == note->note_id
+                        : (note->channel < 0 || mpe.hostChannel == note->channel) &&
+                              (note->key < 0 || mpe.key == note->key);
+                if (!mpe.active || !matches)
+                    continue;
+
+                addMidiMessage(0x80 | (i + 1), mpe.key, 0, time);
+                mpe.active = false;
+                endChokedNotes(i + 1, mpe.key, mpe.noteId, note->header.time);
+            }
+            return;
+        }
+
+        endChokedNotes(note->channel, note->key, note->note_id, note->header.time);
+        if (!capabilities.acceptsMidi)
+            return;
+
+        if (note->channel >= 0 && note->key >= 0)
+        {
+            addMidiMessage(0x80 | (note->channel & 0x0f), note->key, 0, time);
+            return;
+        }
+
+        for (int channel = 0; channel < 16; ++channel)
+            if (note->channel < 0 || note->channel == channel)
+                addMidiMessage(0xb0 | channel, 120, 0, time);
+    }
+
+    void sendMpeExpression(const clap_event_note_expression *expression, int time)
+    {
+        const auto index =
+            findMpeChannel(expression->note_id, expression->channel, expression->key);
+        if (index < 0)
+            return;
+
+        const auto channel = index + 1;
+        const auto toMidiByte = [](double value) {
+            return (int)juce::MidiMessage::floatValueToMidiByte((float)value);
+        };
+        switch (expression->expression_id)
+        {
+        case CLAP_NOTE_EXPRESSION_TUNING:
+        {
+            const auto bend = juce::jlimit(
+                0, 16383, 8192 + juce::roundToInt(expression->value / mpePitchBendRange * 8192.0));
+            addMidiMessage(0xe0 | channel, bend & 0x7f, bend >> 7, time);
+        }
+        break;
+        case CLAP_NOTE_EXPRESSION_PRESSURE:
+            addMidiMessage(0xd0 | channel, toMidiByte(expression->value), 0, time);
+            break;
+        case CLAP_NOTE_EXPRESSION_BRIGHTNESS:
+            addMidiMessage(0xb0 | channel, 74, toMidiByte(expression->value), time);
+            break;
+        case CLAP_NOTE_EXPRESSION_VOLUME:
+            addMidiMessage(0xb0 | channel, 7,
+                           juce::jlimit(0, 127, juce::roundToInt(expression->value * 100.0)), time);
+            break;
+        case CLAP_NOTE_EXPRESSION_PAN:
+            addMidiMessage(0xb0 | channel, 10, toMidiByte(expression->value), time);
+            break;
+        default:
+            break; // vibrato and expression have no MPE equivalent
+        }
+    }
+
+    /*
+     * Parameter values and monophonic modulation amounts are collected while a sub-block's
+     * events are dispatched, by parameter index, and only the last of each is applied before
+     * the sub-block is processed. Under dense automation that saves a setValue() and a round
+     * of listener calls for every value the processor would never have seen anyway. Events
+     * handed to handleDirectEvent() apply what's pending first, so the handler sees every
+     * change which came before it.
+     */
+    struct PendingParamChange
+    {
+        JUCEParameterVariant *param{nullptr}; // set while this parameter has a change pending
+        double value{0.0}, modAmount{0.0};
+        bool hasValue{false}, hasMod{false};
+    };
+    std::vector<PendingParamChange> pendingParamChanges; // indexed by JUCE parameter index
+    std::vector<int> pendingParamIndices;                // in the order they were first changed
+
+    PendingParamChange *getPendingParamChange(JUCEParameterVariant &param)
+    {
+        const auto index = param.processorParam->getParameterIndex();
+        if (!juce::isPositiveAndBelow(index, (int)pendingParamChanges.size()))
+            return nullptr; // not one of the processor's own, so apply it straight away
+
+        auto &pending = pendingParamChanges[(size_t)index];
+        if (pending.param == nullptr)
+        {
+            pending.param = &param;
+            pendingParamIndices.push_back(index);
+        }
+        return &pending;
+    }
+
+    void applyPendingParamChanges()
+    {
+        for (auto index : pendingParamIndices)
+        {
+            auto &pending = pendingParamChanges[(size_t)index];
+            if (pending.hasValue)
+                paramSetValueAndNotifyIfChanged(*pending.param, (float)pending.value);
+            if (pending.hasMod)
+                pending.param->clapExtParameter->applyMonophonicModulation(pending.modAmount);
+            pending = PendingParamChange{};
+        }
+        pendingParamIndices.clear();
+    }
+
     void paramSetValueAndNotifyIfChanged(JUCEParameterVariant &param, float newValue)
     {
         newValue = getNormalisedParameterValue(param, newValue);
@@ -1530,6 +2879,9 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
 
     void onMainThread() noexcept override
     {
+        if (parallelTaskPoolWanted.load(std::memory_order_relaxed))
+            startParallelTaskPool();
+
 #if 0 // PARAM_LISTENERS_ON_MAIN_THREAD
       // handle parameter change listener callbacks
         juce::ScopedValueSetter<bool> suppressCallbacks{supressParameterChangeMessages, true};
@@ -1544,7 +2896,7 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
     bool implementsLatency() const noexcept override { return true; }
     uint32_t latencyGet() const noexcept override
     {
-        return (uint32_t)processor->getLatencySamples();
+        return (uint32_t)(processor->getLatencySamples() + getWrapperLatencySamples());
     }
 
     bool implementsTail() const noexcept override { return true; }
@@ -1571,295 +2923,1778 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
     bool implementsRender() const noexcept override { return true; }
     bool renderSetMode(clap_plugin_render_mode mode) noexcept override
     {
+        const auto offline = mode == CLAP_RENDER_OFFLINE;
         processor->setNonRealtime(mode != CLAP_RENDER_REALTIME);
+        if (offlineRender.exchange(offline) == offline)
+            return true;
+
+        // anything the processor queued during the render still has to reach the host
+        if (!offline && capabilities.hostParams)
+            _host.paramsRequestFlush();
+
+        if (processorAsClapExtensions)
+            processorAsClapExtensions->renderModeChanged(offline);
         return true;
     }
 
-    juce::MidiBuffer midiBuffer;
+    std::atomic<bool> offlineRender{false};
 
-    clap_process_status process(const clap_process *process) noexcept override
+    /*
+     * The event resolution for this block. Offline renders use the realtime resolution unless
+     * the processor has chosen one of their own, but they only ever split at events: the
+     * fixed-size sub-blocks of CLAP_ALWAYS_SPLIT_BLOCK are skipped, as nothing is waiting on
+     * them when the host isn't playing in realtime. Together with not asking the host to
+     * flush parameters (see requestParamsFlush()), that is what the offline fast path skips.
+     */
+    int getProcessEventsResolution() const
     {
-        // Since the playhead is *only* good inside juce audio processor process,
-        // we can just keep this little transient pointer here
-        if (process->transport)
-        {
-            hasTransportInfo = true;
-            transportInfo = process->transport;
-        }
-        else
+        auto resolution = -1;
+        if (processorAsClapExtensions != nullptr)
         {
-            hasTransportInfo = false;
-            transportInfo = nullptr;
+            if (offlineRender.load(std::memory_order_relaxed))
+                resolution = processorAsClapExtensions->offlineEventsResolution.load(
+                    std::memory_order_relaxed);
+            if (resolution < 0)
+                resolution = processorAsClapExtensions->realtimeEventsResolution.load(
+                    std::memory_order_relaxed);
         }
+        return resolution < 0 ? CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES : resolution;
+    }
 
-        if (processorAsClapProperties)
-            processorAsClapProperties->clap_transport = process->transport;
-
-        auto ov = process->out_events;
-        pushUIQueueToOutputEvents(ov);
+    bool splitsAtEveryResolution() const
+    {
+        return CLAP_ALWAYS_SPLIT_BLOCK != 0 && !offlineRender.load(std::memory_order_relaxed);
+    }
 
-        if (processorAsClapExtensions && processorAsClapExtensions->supportsDirectProcess())
-            return processorAsClapExtensions->clap_direct_process(process);
+    juce::MidiBuffer midiBuffer;
 
+    /*
+     * The MIDI buffer is reserved at activation with room for a short message on every sample
+     * of the largest block, or twice the most we've seen it hold, whichever is more. If it
+     * still has to grow on the audio thread we count that in the diagnostics, and the next
+     * activation reserves enough.
+     */
+    static constexpr int midiBytesPerShortMessage = (int)(sizeof(int32_t) + sizeof(uint16_t) + 3);
+    int midiBufferBytes{0}, midiBufferPeakBytes{0};
+
+    int getMidiBufferReservation(int maxFrameCount) const
+    {
+        return juce::jmax(2048, maxFrameCount * midiBytesPerShortMessage, midiBufferPeakBytes * 2);
+    }
+
+    void clearMidiBuffer()
+    {
+        if (midiBuffer.isEmpty())
+            return;
+
+        const auto usedBytes = midiBuffer.data.size();
+        midiBufferPeakBytes = juce::jmax(midiBufferPeakBytes, usedBytes);
+        if (usedBytes > midiBufferBytes)
+        {
+            midiBufferBytes = usedBytes; // only count each new high-water mark
+            if (processorAsClapProperties)
+                processorAsClapProperties->clap_diagnostics.midi_buffer_allocations.fetch_add(
+                    1, std::memory_order_relaxed);
+        }
+        midiBuffer.clear();
+    }
+
+    /*
+     * The block's input events, fetched from the host once at the start of the block so the
+     * split scan and the dispatch loop walk an array rather than calling back into the host
+     * for every look at an event. Growing past the reservation counts in the diagnostics,
+     * and the next activation reserves for the peak.
+     */
+    struct BlockEvent
+    {
+        int time;
+        const clap_event_header_t *header;
+    };
+    std::vector<BlockEvent> blockEvents;
+    int blockEventsPeak{0};
+
+    void gatherBlockEvents(const clap_input_events *events)
+    {
+        const auto numEvents = events->size(events);
+        if (numEvents > blockEvents.capacity() && processorAsClapProperties)
+            processorAsClapProperties->clap_diagnostics.input_event_allocations.fetch_add(
+                1, std::memory_order_relaxed);
+        blockEventsPeak = juce::jmax(blockEventsPeak, (int)numEvents);
+
+        blockEvents.clear();
+        for (uint32_t i = 0; i < numEvents; ++i)
+        {
+            const auto *event = events->get(events, i);
+            blockEvents.push_back({(int)event->time, event});
+        }
+    }
+
+    void setBlockTransport(const clap_event_transport *transport)
+    {
+        // Since the playhead is *only* good inside juce audio processor process,
+        // we can just keep this little transient pointer here
+        if (transport)
+        {
+            hasTransportInfo = true;
+            transportInfo = transport;
+        }
+        else
+        {
+            hasTransportInfo = false;
+            transportInfo = nullptr;
+        }
+
+        if (processorAsClapProperties)
+            processorAsClapProperties->clap_transport = transport;
+    }
+
+    clap_process_status process(const clap_process *process) noexcept override
+    {
+        // the worker sets its own copy of the transport, once it's done with the last block
+        if (processingWorker == nullptr)
+            setBlockTransport(process->transport);
+
+        if (capabilities.directProcess)
+        {
+            pushUIQueueToOutputEvents(process->out_events);
+            return processorAsClapExtensions->clap_direct_process(process);
+        }
+
+        // everything we send goes into the output event list first, to go out in time order
+        blockOutputEvents.clear();
+        auto blockProcess = *process;
+        blockProcess.out_events = &blockOutputEvents.outputEvents;
+        pushUIQueueToOutputEvents(blockProcess.out_events);
+        sendPendingNoteEnds(blockOutputEvents);
+
+        const auto numSamples = (int)process->frames_count;
+        auto events = process->in_events;
+        auto numEvents = (int)events->size(events);
+
+        if (capabilities.sleepOnSilence)
+        {
+            if (numEvents == 0 && inputsAreSilent(process))
+            {
+                // only skip once the tail from the last non-silent input has rung out
+                const auto canSleep = silentInputSamples >= sleepAfterSilentSamples;
+                if (silentInputSamples < sleepAfterSilentSamples)
+                    silentInputSamples += numSamples;
+
+                if (canSleep)
+                {
+                    clearOutputs(process);
+                    sendOutputEvents(process->out_events);
+                    return CLAP_PROCESS_SLEEP;
+                }
+            }
+            else
+            {
+                silentInputSamples = 0;
+            }
+        }
+
+        const auto hostCalledWithDouble =
+            capabilities.doubleHostBuffers && hostProvidesDoubleBuffers(process);
+        if (processingWorker != nullptr)
+            exchangeWithWorker(&blockProcess, hostCalledWithDouble);
+        else
+            (this->*chooseBlockProcessLoop(hostCalledWithDouble))(&blockProcess);
+
+        if (capabilities.constantOutputDetection)
+            markConstantOutputs(process, hostCalledWithDouble);
+
+        sendOutputEvents(process->out_events);
+        return CLAP_PROCESS_CONTINUE;
+    }
+
+    /*
+     * The block's output events (UI parameter changes, the processor's outbound events and
+     * translated MIDI) are collected as they are produced, then merged by time and handed to
+     * the host in one ordered pass, so neither the host nor the plugin has to sort them.
+     * They are collected in blockOutputEvents, which is declared along with EventList below.
+     */
+    void sendOutputEvents(const clap_output_events *ov)
+    {
+        if (blockOutputEvents.numDropped > 0 && processorAsClapProperties)
+            processorAsClapProperties->clap_diagnostics.dropped_output_events.fetch_add(
+                blockOutputEvents.numDropped, std::memory_order_relaxed);
+
+        blockOutputEvents.sortByTime();
+        for (uint32_t i = 0; i < (uint32_t)blockOutputEvents.offsets.size(); ++i)
+            ov->try_push(ov, blockOutputEvents.at(i));
+        blockOutputEvents.clear();
+    }
+
+    /*
+     * The process loop is instantiated for each combination of host sample type, processing
+     * sample type, MIDI output handling, MIDI input handling and sub-block split, so none of
+     * those are decided per sub-block or per event. activate() fills a table with this
+     * plugin's instantiations, and each block picks one by which buffers the host gave us and
+     * how the block is split, which follows the event resolution and offline rendering.
+     */
+    enum class MidiOutput
+    {
+        none,
+        outboundEvents, // the processor pushes its own events with addOutboundEventsToQueue
+        midiEvents      // we translate the processor's MIDI output buffer
+    };
+    template <MidiOutput midiOutput>
+    using MidiOutputTag = std::integral_constant<MidiOutput, midiOutput>;
+
+    enum class MidiInput
+    {
+        none,      // the processor doesn't take MIDI, so notes and MIDI aren't translated
+        midiBuffer // notes and MIDI go into the processor's MIDI buffer
+    };
+    template <MidiInput midiInput>
+    using MidiInputTag = std::integral_constant<MidiInput, midiInput>;
+
+    enum class SubBlockSplit
+    {
+        wholeBlock,      // sample-accurate events are off
+        atEvents,        // at split events, rounded up to the event resolution
+        everyResolution, // CLAP_ALWAYS_SPLIT_BLOCK: every resolution samples, events or not
+        numSplits
+    };
+    template <SubBlockSplit split>
+    using SubBlockSplitTag = std::integral_constant<SubBlockSplit, split>;
+
+    using ProcessLoop = void (ClapJuceWrapper::*)(const clap_process *);
+    // indexed by whether the host called us with doubles, then by SubBlockSplit
+    ProcessLoop processLoops[2][(size_t)SubBlockSplit::numSplits]{};
+    int subBlockResolution{0}; // the event resolution of the block being processed
+
+    /** Picks the loop for this block, on the thread which is about to run it. */
+    ProcessLoop chooseBlockProcessLoop(bool hostCalledWithDouble)
+    {
+        subBlockResolution = getProcessEventsResolution();
+        auto split = SubBlockSplit::wholeBlock;
+        if (subBlockResolution > 0)
+            split = splitsAtEveryResolution() ? SubBlockSplit::everyResolution
+                                              : SubBlockSplit::atEvents;
+        return processLoops[hostCalledWithDouble ? 1 : 0][(size_t)split];
+    }
+
+    void chooseProcessLoops()
+    {
+        auto midiOutput = MidiOutput::none;
+        if (capabilities.outboundEvents)
+            midiOutput = MidiOutput::outboundEvents;
+        else if (processor->producesMidi())
+            midiOutput = MidiOutput::midiEvents;
+        const auto midiInput = capabilities.acceptsMidi ? MidiInput::midiBuffer : MidiInput::none;
+
+        for (size_t split = 0; split < (size_t)SubBlockSplit::numSplits; ++split)
+        {
+            processLoops[0][split] =
+                chooseProcessLoop<float>(midiOutput, midiInput, (SubBlockSplit)split);
+            processLoops[1][split] =
+                chooseProcessLoop<double>(midiOutput, midiInput, (SubBlockSplit)split);
+#if !CLAP_JUCE_SPECIALISE_PROCESS_LOOP
+            if (fixedBlockSize <= 0)
+                processLoops[0][split] = processLoops[1][split] =
+                    &ClapJuceWrapper::processUnspecialisedLoop;
+#endif
+        }
+    }
+
+    template <typename HostType>
+    ProcessLoop chooseProcessLoop(MidiOutput midiOutput, MidiInput midiInput, SubBlockSplit split)
+    {
+        if (processesInDouble(std::is_same<HostType, double>::value))
+            return chooseProcessLoop<HostType, double>(midiOutput, midiInput, split);
+        return chooseProcessLoop<HostType, float>(midiOutput, midiInput, split);
+    }
+
+    template <typename HostType, typename ProcessType>
+    ProcessLoop chooseProcessLoop(MidiOutput midiOutput, MidiInput midiInput, SubBlockSplit split)
+    {
+        switch (midiOutput)
+        {
+        case MidiOutput::outboundEvents:
+            return chooseProcessLoop<HostType, ProcessType, MidiOutput::outboundEvents>(midiInput,
+                                                                                         split);
+        case MidiOutput::midiEvents:
+            return chooseProcessLoop<HostType, ProcessType, MidiOutput::midiEvents>(midiInput,
+                                                                                     split);
+        case MidiOutput::none:
+            break;
+        }
+        return chooseProcessLoop<HostType, ProcessType, MidiOutput::none>(midiInput, split);
+    }
+
+    template <typename HostType, typename ProcessType, MidiOutput midiOutput>
+    ProcessLoop chooseProcessLoop(MidiInput midiInput, SubBlockSplit split) const
+    {
+        if (midiInput == MidiInput::midiBuffer)
+            return chooseProcessLoop<HostType, ProcessType, midiOutput, MidiInput::midiBuffer>(
+                split);
+        return chooseProcessLoop<HostType, ProcessType, midiOutput, MidiInput::none>(split);
+    }
+
+    template <typename HostType, typename ProcessType, MidiOutput midiOutput, MidiInput midiInput>
+    ProcessLoop chooseProcessLoop(SubBlockSplit split) const
+    {
+        // the fixed block loop always runs whole fixed blocks, so it never splits
+        if (fixedBlockSize > 0)
+            return &ClapJuceWrapper::processFixedBlockLoop<HostType, ProcessType, midiOutput,
+                                                           midiInput>;
+
+        switch (split)
+        {
+        case SubBlockSplit::atEvents:
+            return &ClapJuceWrapper::processLoop<HostType, ProcessType, midiOutput, midiInput,
+                                                 SubBlockSplit::atEvents>;
+        case SubBlockSplit::everyResolution:
+            return &ClapJuceWrapper::processLoop<HostType, ProcessType, midiOutput, midiInput,
+                                                 SubBlockSplit::everyResolution>;
+        case SubBlockSplit::wholeBlock:
+        case SubBlockSplit::numSplits:
+            break;
+        }
+        return &ClapJuceWrapper::processLoop<HostType, ProcessType, midiOutput, midiInput,
+                                             SubBlockSplit::wholeBlock>;
+    }
+
+    template <typename HostType, typename ProcessType, MidiOutput midiOutput, MidiInput midiInput,
+              SubBlockSplit split>
+    void processLoop(const clap_process *process)
+    {
+        const auto numSamples = (int)process->frames_count;
+        gatherBlockEvents(process->in_events);
+        const auto numEvents = blockEvents.size();
+        size_t currentEvent = 0;
+
+        auto &pointers = getChannelPointers((HostType *)nullptr);
+        bindHostChannels(process, pointers);
+        countSharedChannels(pointers, (ProcessType *)nullptr);
+        beginNoteEndOutput(getLoopOutputEvents());
+
+        buildSubBlockSchedule(numSamples, subBlockResolution, SubBlockSplitTag<split>{});
+        size_t subBlockIndex = 0;
+
+        // we can't advance `n` until we know how many samples we're processing,
+        // so we'll increment it inside the loop.
+        for (int n = 0; n < numSamples;)
+        {
+            // split where the schedule computed at the start of the block says so
+            const auto numSamplesToProcess = subBlockSizes[subBlockIndex++];
+
+            // process the events in this sub-block
+            for (; currentEvent < numEvents; ++currentEvent)
+            {
+                if (blockEvents[currentEvent].time >= n + numSamplesToProcess)
+                    break;
+                process_clap_event(blockEvents[currentEvent].header, n,
+                                   MidiInputTag<midiInput>{});
+            }
+            applyPendingParamChanges();
+
+            noteEndOffset = n;
+            noteEndBlockLength = numSamplesToProcess;
+            processHostSubBlock(pointers, (ProcessType *)nullptr, n, numSamplesToProcess);
+            sendMidiOutput(process->out_events, n, MidiOutputTag<midiOutput>{});
+            clearMidiBuffer();
+
+            n += numSamplesToProcess;
+        }
+
+        // process any leftover events
+        for (; currentEvent < numEvents; ++currentEvent)
+            process_clap_event(blockEvents[currentEvent].header, numSamples,
+                               MidiInputTag<midiInput>{});
+        applyPendingParamChanges();
+        noteEndEvents = nullptr;
+    }
+
+#if !CLAP_JUCE_SPECIALISE_PROCESS_LOOP
+    /*
+     * The loop as it was before it was specialised, built with
+     * CLAP_JUCE_SPECIALISE_PROCESS_LOOP=0 for the benchmark in tests/. The sample types, MIDI
+     * output and split are worked out again for each block or sub-block, and whether the
+     * processor takes MIDI for each event, instead of by the instantiation.
+     */
+    void processUnspecialisedLoop(const clap_process *process)
+    {
         const auto numSamples = (int)process->frames_count;
+        gatherBlockEvents(process->in_events);
+        const auto numEvents = blockEvents.size();
+        size_t currentEvent = 0;
+
+        const auto hostCalledWithDouble =
+            capabilities.doubleHostBuffers && hostProvidesDoubleBuffers(process);
+        const auto processDouble = processesInDouble(hostCalledWithDouble);
+        if (hostCalledWithDouble)
+            bindHostChannels(process, doubleChannels);
+        else
+            bindHostChannels(process, floatChannels);
+        if (hostCalledWithDouble && processDouble)
+            countSharedChannels(doubleChannels, (double *)nullptr);
+        else if (!hostCalledWithDouble && !processDouble)
+            countSharedChannels(floatChannels, (float *)nullptr);
+        beginNoteEndOutput(getLoopOutputEvents());
+
+        buildSubBlockSchedule(numSamples, getProcessEventsResolution());
+        size_t subBlockIndex = 0;
+
+        for (int n = 0; n < numSamples;)
+        {
+            const auto numSamplesToProcess = subBlockSizes[subBlockIndex++];
+
+            for (; currentEvent < numEvents; ++currentEvent)
+            {
+                if (blockEvents[currentEvent].time >= n + numSamplesToProcess)
+                    break;
+                process_clap_event(blockEvents[currentEvent].header, n);
+            }
+            applyPendingParamChanges();
+
+            noteEndOffset = n;
+            noteEndBlockLength = numSamplesToProcess;
+            if (hostCalledWithDouble && processDouble)
+                processHostSubBlock(doubleChannels, (double *)nullptr, n, numSamplesToProcess);
+            else if (hostCalledWithDouble)
+                processHostSubBlock(doubleChannels, (float *)nullptr, n, numSamplesToProcess);
+            else if (processDouble)
+                processHostSubBlock(floatChannels, (double *)nullptr, n, numSamplesToProcess);
+            else
+                processHostSubBlock(floatChannels, (float *)nullptr, n, numSamplesToProcess);
+
+            if (capabilities.outboundEvents)
+                sendMidiOutput(process->out_events, n, MidiOutputTag<MidiOutput::outboundEvents>{});
+            else if (processor->producesMidi())
+                sendMidiOutput(process->out_events, n, MidiOutputTag<MidiOutput::midiEvents>{});
+            clearMidiBuffer();
+
+            n += numSamplesToProcess;
+        }
+
+        for (; currentEvent < numEvents; ++currentEvent)
+            process_clap_event(blockEvents[currentEvent].header, numSamples);
+        applyPendingParamChanges();
+        noteEndEvents = nullptr;
+    }
+
+    void buildSubBlockSchedule(int numSamples, int resolution)
+    {
+        if (resolution <= 0)
+            buildSubBlockSchedule(numSamples, resolution,
+                                  SubBlockSplitTag<SubBlockSplit::wholeBlock>{});
+        else if (splitsAtEveryResolution())
+            buildSubBlockSchedule(numSamples, resolution,
+                                  SubBlockSplitTag<SubBlockSplit::everyResolution>{});
+        else
+            buildSubBlockSchedule(numSamples, resolution,
+                                  SubBlockSplitTag<SubBlockSplit::atEvents>{});
+    }
+#endif
+
+    ChannelPointers<float> &getChannelPointers(float *) { return floatChannels; }
+    ChannelPointers<double> &getChannelPointers(double *) { return doubleChannels; }
+    juce::AudioBuffer<float> &getConversionScratch(float *) { return floatConversionScratch; }
+    juce::AudioBuffer<double> &getConversionScratch(double *) { return doubleConversionScratch; }
+
+    // the processor runs straight on the host buffers...
+    template <typename SampleType>
+    void processHostSubBlock(ChannelPointers<SampleType> &pointers, SampleType *, int sampleOffset,
+                             int numSamples)
+    {
+        processSubBlock(pointers, sampleOffset, numSamples);
+    }
+
+    // ... unless it runs in a different precision
+    template <typename HostType, typename ProcessType>
+    void processHostSubBlock(ChannelPointers<HostType> &pointers, ProcessType *, int sampleOffset,
+                             int numSamples)
+    {
+        processConvertedSubBlock(pointers, getConversionScratch((ProcessType *)nullptr),
+                                 sampleOffset, numSamples);
+    }
+
+    void sendMidiOutput(const clap_output_events *, int, MidiOutputTag<MidiOutput::none>) {}
+
+    void sendMidiOutput(const clap_output_events *ov, int sampleOffset,
+                        MidiOutputTag<MidiOutput::outboundEvents>)
+    {
+        processorAsClapExtensions->addOutboundEventsToQueue(ov, midiBuffer, sampleOffset);
+    }
+
+    void sendMidiOutput(const clap_output_events *ov, int sampleOffset,
+                        MidiOutputTag<MidiOutput::midiEvents>)
+    {
+        for (const auto meta : midiBuffer)
+            pushMidiOutputEvent(ov, meta.data, meta.numBytes, meta.samplePosition + sampleOffset);
+    }
+
+    /*
+     * Sysex goes out pointing at the message in the MIDI buffer. That's fine because out_events
+     * is our own output list by now, which copies the payload into its arena, where it stays
+     * until the next block, long after the host has taken the event.
+     */
+    static void pushMidiOutputEvent(const clap_output_events *ov, const uint8_t *data,
+                                    int msgSize, int time)
+    {
+        if (msgSize > 0 && data[0] == 0xf0)
+        {
+            auto evt = clap_event_midi_sysex();
+            evt.header.size = sizeof(clap_event_midi_sysex);
+            evt.header.type = (uint16_t)CLAP_EVENT_MIDI_SYSEX;
+            evt.header.time = uint32_t(time);
+            evt.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+            evt.header.flags = 0;
+            evt.port_index = 0;
+            evt.buffer = data;
+            evt.size = (uint32_t)msgSize;
+            ov->try_push(ov, reinterpret_cast<const clap_event_header *>(&evt));
+        }
+        else if (msgSize >= 1 && msgSize <= 3)
+        {
+            auto evt = clap_event_midi();
+            evt.header.size = sizeof(clap_event_midi);
+            evt.header.type = (uint16_t)CLAP_EVENT_MIDI;
+            evt.header.time = uint32_t(time);
+            evt.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+            evt.header.flags = 0;
+            evt.port_index = 0;
+            memcpy(&evt.data, data, static_cast<size_t>(msgSize) * sizeof(uint8_t));
+            for (auto i = msgSize; i < 3; ++i)
+                evt.data[i] = 0;
+            ov->try_push(ov, reinterpret_cast<const clap_event_header *>(&evt));
+        }
+    }
+
+    /*
+     * Fixed block size mode. The processor always gets blocks of exactly fixedBlockSize
+     * samples: each host sample is swapped into the fixed block at the current position,
+     * taking out the processed sample from the previous run of the block, which adds one
+     * block of latency. Events are applied at the position their sample is queued at, so
+     * parameter changes land before the block which contains them, and MIDI is re-timed
+     * into it. Output which falls beyond the end of the host block, whether translated MIDI,
+     * outbound events or note ends, is carried over to the next one.
+     */
+    int fixedBlockSize{0}, fixedBlockPosition{0};
+    juce::AudioBuffer<float> floatFixedBlock;
+    juce::AudioBuffer<double> doubleFixedBlock;
+    juce::MidiBuffer fixedBlockMidiOutput, fixedBlockMidiScratch;
+
+    juce::AudioBuffer<float> &getFixedBlock(float *) { return floatFixedBlock; }
+    juce::AudioBuffer<double> &getFixedBlock(double *) { return doubleFixedBlock; }
+
+    int resolveFixedBlockSize() const
+    {
+        auto blockSize = -1;
+        if (processorAsClapExtensions)
+            blockSize = processorAsClapExtensions->getFixedBlockSize();
+        if (blockSize < 0)
+            blockSize = CLAP_FIXED_BLOCK_SIZE;
+        return juce::jmax(0, blockSize);
+    }
+
+    void prepareFixedBlock()
+    {
+        floatFixedBlock.setSize(0, 0);
+        doubleFixedBlock.setSize(0, 0);
+        fixedBlockMidiOutput.clear();
+        fixedBlockPosition = 0;
+        if (fixedBlockSize <= 0)
+            return;
+
+        const auto numChannels =
+            (int)juce::jmax(inputChannelRoutes.size(), outputChannelRoutes.size());
+        if (!processesInDouble(false))
+        {
+            floatFixedBlock.setSize(numChannels, fixedBlockSize);
+            floatFixedBlock.clear();
+        }
+        if (processesInDouble(supportsDoubleHostBuffers()))
+        {
+            doubleFixedBlock.setSize(numChannels, fixedBlockSize);
+            doubleFixedBlock.clear();
+        }
+        fixedBlockMidiOutput.ensureSize((size_t)midiBufferBytes);
+        fixedBlockMidiScratch.ensureSize((size_t)midiBufferBytes);
+        for (auto &queued : fixedBlockOutputEvents)
+            queued.prepare(juce::jmax((size_t)(64 * 1024), (size_t)midiBufferBytes * 8,
+                                      queued.peakBytes * 2));
+    }
+
+    template <typename HostType, typename ProcessType, MidiOutput midiOutput, MidiInput midiInput>
+    void processFixedBlockLoop(const clap_process *process)
+    {
+        const auto numSamples = (int)process->frames_count;
+        gatherBlockEvents(process->in_events);
+        const auto numEvents = blockEvents.size();
+        size_t currentEvent = 0;
+
+        auto &pointers = getChannelPointers((HostType *)nullptr);
+        bindHostChannels(process, pointers);
+        auto &queuedOutput = fixedBlockOutputEvents[fixedBlockOutputIndex];
+        beginNoteEndOutput(queuedOutput);
+        noteEndBlockLength = fixedBlockSize;
+        auto &block = getFixedBlock((ProcessType *)nullptr);
+
+        for (int n = 0; n < numSamples;)
+        {
+            const auto numSamplesToQueue =
+                juce::jmin(fixedBlockSize - fixedBlockPosition, numSamples - n);
+
+            // events go in at the position their sample is queued at in the fixed block
+            for (; currentEvent < numEvents; ++currentEvent)
+            {
+                if (blockEvents[currentEvent].time >= n + numSamplesToQueue)
+                    break;
+                process_clap_event(blockEvents[currentEvent].header, n - fixedBlockPosition,
+                                   MidiInputTag<midiInput>{});
+            }
+
+            exchangeFixedBlockSamples(pointers, block, n, numSamplesToQueue);
+            fixedBlockPosition += numSamplesToQueue;
+            n += numSamplesToQueue;
+
+            if (fixedBlockPosition == fixedBlockSize)
+            {
+                applyPendingParamChanges();
+                noteEndOffset = n; // the block's output starts coming out here
+                runProcessBlock(block);
+                queueFixedBlockMidiOutput(&queuedOutput.outputEvents, n,
+                                          MidiOutputTag<midiOutput>{});
+                clearMidiBuffer();
+                fixedBlockPosition = 0;
+            }
+        }
+
+        // process any leftover events
+        for (; currentEvent < numEvents; ++currentEvent)
+            process_clap_event(blockEvents[currentEvent].header, numSamples - fixedBlockPosition,
+                               MidiInputTag<midiInput>{});
+        applyPendingParamChanges();
+        noteEndEvents = nullptr;
+
+        sendFixedBlockMidiOutput(process->out_events, numSamples, MidiOutputTag<midiOutput>{});
+        sendFixedBlockOutputEvents(process->out_events, numSamples);
+    }
+
+    template <typename HostType, typename ProcessType>
+    void exchangeFixedBlockSamples(ChannelPointers<HostType> &pointers,
+                                   juce::AudioBuffer<ProcessType> &block, int sampleOffset,
+                                   int numSamples)
+    {
+        const auto numInputs = pointers.inputs.size();
+        const auto numOutputs = pointers.outputs.size();
+        for (size_t ch = 0; ch < juce::jmax(numInputs, numOutputs); ++ch)
+        {
+            auto *queued = block.getWritePointer((int)ch, fixedBlockPosition);
+            const auto *in = ch < numInputs ? pointers.inputs[ch] + sampleOffset : nullptr;
+            auto *out = ch < numOutputs ? pointers.outputs[ch] + sampleOffset : nullptr;
+
+            if (in != nullptr && out != nullptr)
+            {
+                for (int i = 0; i < numSamples; ++i)
+                {
+                    // read the input first, since the host may be processing in place
+                    const auto input = (ProcessType)in[i];
+                    out[i] = (HostType)queued[i];
+                    queued[i] = input;
+                }
+            }
+            else if (out != nullptr)
+            {
+                for (int i = 0; i < numSamples; ++i)
+                    out[i] = (HostType)queued[i];
+                juce::FloatVectorOperations::clear(queued, numSamples);
+            }
+            else
+            {
+                for (int i = 0; i < numSamples; ++i)
+                    queued[i] = (ProcessType)in[i];
+            }
+        }
+    }
+
+    void queueFixedBlockMidiOutput(const clap_output_events *, int, MidiOutputTag<MidiOutput::none>)
+    {
+    }
+
+    void queueFixedBlockMidiOutput(const clap_output_events *ov, int blockEnd,
+                                   MidiOutputTag<MidiOutput::outboundEvents>)
+    {
+        // the processed block starts playing at the point it was completed
+        processorAsClapExtensions->addOutboundEventsToQueue(ov, midiBuffer, blockEnd);
+    }
+
+    void queueFixedBlockMidiOutput(const clap_output_events *, int blockEnd,
+                                   MidiOutputTag<MidiOutput::midiEvents>)
+    {
+        for (const auto meta : midiBuffer)
+            fixedBlockMidiOutput.addEvent(meta.data, meta.numBytes,
+                                          meta.samplePosition + blockEnd);
+    }
+
+    template <typename Tag> void sendFixedBlockMidiOutput(const clap_output_events *, int, Tag)
+    {
+    }
+
+    void sendFixedBlockMidiOutput(const clap_output_events *ov, int numSamples,
+                                  MidiOutputTag<MidiOutput::midiEvents>)
+    {
+        if (fixedBlockMidiOutput.isEmpty())
+            return;
+
+        fixedBlockMidiScratch.clear();
+        for (const auto meta : fixedBlockMidiOutput)
+        {
+            if (meta.samplePosition < numSamples)
+                pushMidiOutputEvent(ov, meta.data, meta.numBytes, meta.samplePosition);
+            else
+                fixedBlockMidiScratch.addEvent(meta.data, meta.numBytes,
+                                               meta.samplePosition - numSamples);
+        }
+        fixedBlockMidiOutput.swapWith(fixedBlockMidiScratch);
+    }
+
+    /** The same for outbound events and note ends, which are queued as CLAP events. */
+    void sendFixedBlockOutputEvents(const clap_output_events *ov, int numSamples)
+    {
+        auto &queued = fixedBlockOutputEvents[fixedBlockOutputIndex];
+        auto &remaining = fixedBlockOutputEvents[1 - fixedBlockOutputIndex];
+        if (queued.numDropped > 0 && processorAsClapProperties)
+            processorAsClapProperties->clap_diagnostics.dropped_output_events.fetch_add(
+                queued.numDropped, std::memory_order_relaxed);
+
+        remaining.clear();
+        for (uint32_t i = 0; i < (uint32_t)queued.offsets.size(); ++i)
+        {
+            auto *event = queued.at(i);
+            if ((int)event->time < numSamples)
+            {
+                ov->try_push(ov, event);
+            }
+            else
+            {
+                event->time -= (uint32_t)numSamples;
+                remaining.push(event);
+            }
+        }
+        queued.clear();
+        fixedBlockOutputIndex = 1 - fixedBlockOutputIndex;
+    }
+
+    /*
+     * Worker thread mode. The host callback only swaps the block's audio, events and transport
+     * with a worker thread, which runs the process loop while the host gets on with the next
+     * block. The worker's output is queued behind maxFrameCount samples of silence, which is
+     * the latency we add, and which gives processBlock a whole block period to finish in.
+     * When the transport jumps or starts playing, output still queued from before the jump is
+     * replaced with silence. The wrapper bypass runs on the worker, so it is delayed along with
+     * the rest of the audio, and so are the worker's output events: they wait in
+     * workerDelayedEvents until the host block their audio comes out in.
+     *
+     * EventList copies events into preallocated memory and serves them back as either kind of
+     * CLAP event list. The worker uses it for its events, and process() builds its output in one.
+     */
+    struct EventList
+    {
+        std::vector<uint8_t> data; // events are copied back to back, 8 byte aligned
+        std::vector<uint32_t> offsets;
+        size_t used{0};
+        clap_input_events inputEvents{this, &eventsSize, &eventsGet};
+        clap_output_events outputEvents{this, &eventsTryPush};
+
+        void prepare(size_t capacity)
+        {
+            data.assign(capacity, 0);
+            offsets.reserve(capacity / sizeof(clap_event_header));
+            clear();
+        }
+
+        void clear()
+        {
+            offsets.clear();
+            used = 0;
+            numDropped = 0;
+            droppedBytes = 0;
+        }
+
+        size_t peakBytes{0}; // the most any block has needed
+        uint32_t numDropped{0};
+        size_t droppedBytes{0};  // what didn't fit in this block
+        size_t reservedBytes{0};   // kept back for events pushed with mayUseReserve
+        size_t reservedOffsets{0}; // and the same for the event count
+
+        static size_t align(size_t size) { return (size + 7) & ~(size_t)7; }
+
+        bool push(const clap_event_header *event, bool mayUseReserve = false)
+        {
+            // sysex payloads aren't ours to keep a pointer to, so they get copied too
+            const clap_event_midi_sysex *sysex = nullptr;
+            if (event->space_id == CLAP_CORE_EVENT_SPACE_ID &&
+                event->type == CLAP_EVENT_MIDI_SYSEX)
+                sysex = reinterpret_cast<const clap_event_midi_sysex *>(event);
+
+            const auto eventSize = align(event->size);
+            const auto payloadSize = sysex != nullptr ? align(sysex->size) : 0;
+            const auto available = mayUseReserve ? data.size() : data.size() - reservedBytes;
+            const auto availableOffsets =
+                mayUseReserve ? offsets.capacity() : offsets.capacity() - reservedOffsets;
+            if (used + eventSize + payloadSize > available || offsets.size() >= availableOffsets)
+            {
+                jassertfalse; // more events in this block than we made room for
+                ++numDropped;
+                droppedBytes += eventSize + payloadSize;
+                peakBytes = juce::jmax(peakBytes, used + droppedBytes);
+                return false;
+            }
+
+            memcpy(data.data() + used, event, event->size);
+            if (sysex != nullptr)
+            {
+                auto *payload = data.data() + used + eventSize;
+                memcpy(payload, sysex->buffer, sysex->size);
+                reinterpret_cast<clap_event_midi_sysex *>(data.data() + used)->buffer = payload;
+            }
+            offsets.push_back((uint32_t)used);
+            used += eventSize + payloadSize;
+            peakBytes = juce::jmax(peakBytes, used + droppedBytes);
+            return true;
+        }
+
+        clap_event_header *at(uint32_t index)
+        {
+            return reinterpret_cast<clap_event_header *>(data.data() + offsets[index]);
+        }
+
+        /** A stable insertion sort, since the events mostly arrive in order already. */
+        void sortByTime()
+        {
+            for (size_t i = 1; i < offsets.size(); ++i)
+            {
+                const auto offset = offsets[i];
+                const auto time = at((uint32_t)i)->time;
+                auto j = i;
+                for (; j > 0 && at((uint32_t)(j - 1))->time > time; --j)
+                    offsets[j] = offsets[j - 1];
+                offsets[j] = offset;
+            }
+        }
+
+        static uint32_t eventsSize(const clap_input_events *list)
+        {
+            return (uint32_t) static_cast<EventList *>(list->ctx)->offsets.size();
+        }
+        static const clap_event_header *eventsGet(const clap_input_events *list, uint32_t index)
+        {
+            auto *events = static_cast<EventList *>(list->ctx);
+            return index < events->offsets.size() ? events->at(index) : nullptr;
+        }
+        static bool eventsTryPush(const clap_output_events *list, const clap_event_header *event)
+        {
+            return static_cast<EventList *>(list->ctx)->push(event);
+        }
+    };
+
+    template <typename SampleType> struct WorkerAudio
+    {
+        juce::AudioBuffer<SampleType> inputs, outputs; // the block the worker processes
+        juce::AudioBuffer<SampleType> queue;           // output waiting to go to the host
+        std::vector<SampleType *> inputChannels, outputChannels;
+    };
+
+    class ProcessingWorker : public juce::Thread
+    {
+      public:
+        explicit ProcessingWorker(ClapJuceWrapper &w)
+            : juce::Thread("CLAP processing worker"), wrapper(w)
+        {
+        }
+
+        void run() override
+        {
+            while (!threadShouldExit())
+            {
+                if (!jobReady.wait(50))
+                    continue;
+                if (threadShouldExit())
+                    break;
+
+                wrapper.runWorkerJob();
+                jobDone.signal();
+            }
+        }
+
+        juce::WaitableEvent jobReady, jobDone;
+
+      private:
+        ClapJuceWrapper &wrapper;
+    };
+
+    std::unique_ptr<ProcessingWorker> processingWorker;
+    WorkerAudio<float> floatWorkerAudio;
+    WorkerAudio<double> doubleWorkerAudio;
+    std::vector<clap_audio_buffer> workerInputPorts, workerOutputPorts;
+    EventList workerInputEvents, workerOutputEvents;
+    EventList workerDelayedEvents[2]; // timed from the start of the next host block
+    int workerDelayedIndex{0};
+    EventList blockOutputEvents; // see sendOutputEvents()
+    EventList fixedBlockOutputEvents[2]; // see sendFixedBlockOutputEvents()
+    int fixedBlockOutputIndex{0};
+    clap_event_transport workerTransport{};
+    clap_process workerProcess{};
+    bool workerUsesDouble{false}, workerJobPending{false};
+    int workerLatency{0}, workerQueueRead{0}, workerQueueWrite{0};
+    double workerSampleRate{0.0};
+    bool transportWasPlaying{false};
+    clap_sectime expectedSongPosition{0};
+
+    static void setPortChannels(clap_audio_buffer &port, float **channels)
+    {
+        port.data32 = channels;
+    }
+    static void setPortChannels(clap_audio_buffer &port, double **channels)
+    {
+        port.data64 = channels;
+    }
+
+    template <typename SampleType>
+    static void copySamples(SampleType *dest, const SampleType *src, int numSamples)
+    {
+        juce::FloatVectorOperations::copy(dest, src, numSamples);
+    }
+    static void copySamples(double *dest, const float *src, int numSamples)
+    {
+        convertSamples(dest, src, numSamples);
+    }
+    static void copySamples(float *dest, const double *src, int numSamples)
+    {
+        convertSamples(dest, src, numSamples);
+    }
+
+    void startWorker(double sampleRate, int maxFrameCount)
+    {
+        if (!capabilities.workerThread)
+            return;
+
+        workerSampleRate = sampleRate;
+        workerUsesDouble = capabilities.doubleHostBuffers;
+        floatWorkerAudio = {};
+        doubleWorkerAudio = {};
+        if (workerUsesDouble)
+            prepareWorkerAudio(doubleWorkerAudio, maxFrameCount);
+        else
+            prepareWorkerAudio(floatWorkerAudio, maxFrameCount);
+
+        workerInputEvents.prepare(juce::jmax((size_t)(64 * 1024), workerInputEvents.peakBytes * 2));
+        workerInputEvents.reservedBytes = workerInputEvents.data.size() / 4;
+        workerInputEvents.reservedOffsets = workerInputEvents.offsets.capacity() / 4;
+        workerOutputEvents.prepare(64 * 1024);
+        for (auto &delayed : workerDelayedEvents)
+            delayed.prepare(128 * 1024);
+        workerDelayedIndex = 0;
+        workerProcess = {};
+        workerProcess.audio_inputs = workerInputPorts.data();
+        workerProcess.audio_outputs = workerOutputPorts.data();
+        workerProcess.audio_inputs_count = (uint32_t)workerInputPorts.size();
+        workerProcess.audio_outputs_count = (uint32_t)workerOutputPorts.size();
+        workerProcess.in_events = &workerInputEvents.inputEvents;
+        workerProcess.out_events = &workerOutputEvents.outputEvents;
+        workerJobPending = false;
+        transportWasPlaying = false;
+
+        processingWorker = std::make_unique<ProcessingWorker>(*this);
+        startRealtimeThread(*processingWorker, sampleRate, maxFrameCount);
+    }
+
+    /*
+     * The audio thread blocks on the worker and on the parallel task helpers, so they have to
+     * be scheduled like it is or a busy machine gives us priority inversion and dropouts. JUCE
+     * 7 can start real time threads (which the OS may still refuse, e.g. Linux without an
+     * rtprio limit). Older JUCE can only ask for its highest normal priority, which is a
+     * best effort: it is preemptible, so heavy system load can still cost a block.
+     */
+    static void startRealtimeThread(juce::Thread &thread, double sampleRate, int blockSize)
+    {
+#if JUCE_VERSION >= 0x070006
+        const auto options = juce::Thread::RealtimeOptions{}.withApproximateAudioProcessingTime(
+            blockSize, sampleRate);
+        thread.startRealtimeThread(options);
+#elif JUCE_VERSION >= 0x070003
+        juce::ignoreUnused(sampleRate, blockSize);
+        thread.startRealtimeThread({});
+#else
+        juce::ignoreUnused(sampleRate, blockSize);
+        thread.startThread(10);
+#endif
+    }
+
+    void stopWorker()
+    {
+        if (processingWorker == nullptr)
+            return;
+
+        processingWorker->signalThreadShouldExit();
+        processingWorker->jobReady.signal();
+        processingWorker->stopThread(1000);
+        processingWorker.reset();
+        workerJobPending = false;
+    }
+
+    template <typename SampleType>
+    void prepareWorkerAudio(WorkerAudio<SampleType> &audio, int maxFrameCount)
+    {
+        const auto numInputs = (int)inputChannelRoutes.size();
+        const auto numOutputs = (int)outputChannelRoutes.size();
+        audio.inputs.setSize(numInputs, maxFrameCount);
+        audio.outputs.setSize(numOutputs, maxFrameCount);
+
+        // primed with a block of silence, which is the latency we report
+        audio.queue.setSize(numOutputs, 2 * maxFrameCount);
+        audio.queue.clear();
+        workerQueueRead = 0;
+        workerQueueWrite = maxFrameCount;
+
+        audio.inputChannels.assign(audio.inputs.getArrayOfWritePointers(),
+                                   audio.inputs.getArrayOfWritePointers() + numInputs);
+        audio.outputChannels.assign(audio.outputs.getArrayOfWritePointers(),
+                                    audio.outputs.getArrayOfWritePointers() + numOutputs);
+
+        // the worker's ports look just like the host's, so the routing plan works for both
+        auto buildPorts = [this](bool isInput, std::vector<clap_audio_buffer> &ports,
+                                 std::vector<SampleType *> &channels) {
+            ports.assign((size_t)processor->getBusCount(isInput), clap_audio_buffer{});
+            size_t firstChannel = 0;
+            for (size_t bus = 0; bus < ports.size(); ++bus)
+            {
+                auto &port = ports[bus];
+                port.channel_count = (uint32_t)processor->getChannelCountOfBus(isInput, (int)bus);
+                setPortChannels(port, channels.data() + firstChannel);
+                firstChannel += port.channel_count;
+            }
+        };
+        buildPorts(true, workerInputPorts, audio.inputChannels);
+        buildPorts(false, workerOutputPorts, audio.outputChannels);
+    }
+
+    void waitForWorker()
+    {
+        if (workerJobPending)
+        {
+            processingWorker->jobDone.wait(-1);
+            workerJobPending = false;
+        }
+    }
+
+    void exchangeWithWorker(const clap_process *process, bool hostCalledWithDouble)
+    {
+        waitForWorker();
+        if (transportJumped(process->transport, (int)process->frames_count))
+        {
+            floatWorkerAudio.queue.clear();
+            doubleWorkerAudio.queue.clear();
+        }
+
+        if (hostCalledWithDouble && workerUsesDouble)
+            exchangeWithWorker(process, doubleChannels, doubleWorkerAudio);
+        else if (hostCalledWithDouble)
+            exchangeWithWorker(process, doubleChannels, floatWorkerAudio);
+        else if (workerUsesDouble)
+            exchangeWithWorker(process, floatChannels, doubleWorkerAudio);
+        else
+            exchangeWithWorker(process, floatChannels, floatWorkerAudio);
+    }
+
+    template <typename HostType, typename WorkerType>
+    void exchangeWithWorker(const clap_process *process, ChannelPointers<HostType> &pointers,
+                            WorkerAudio<WorkerType> &audio)
+    {
+        const auto numSamples = (int)process->frames_count;
+        const auto queueSize = audio.queue.getNumSamples();
+        jassert(numSamples <= audio.inputs.getNumSamples());
+        bindHostChannels(process, pointers);
+
+        // inputs first, since the host may have given us the same buffers for the outputs
+        for (size_t ch = 0; ch < pointers.inputs.size(); ++ch)
+            copySamples(audio.inputChannels[ch], pointers.inputs[ch], numSamples);
+
+        const auto firstPart = juce::jmin(numSamples, queueSize - workerQueueRead);
+        for (size_t ch = 0; ch < pointers.outputs.size(); ++ch)
+        {
+            const auto *queued = audio.queue.getReadPointer((int)ch);
+            copySamples(pointers.outputs[ch], queued + workerQueueRead, firstPart);
+            copySamples(pointers.outputs[ch] + firstPart, queued, numSamples - firstPart);
+        }
+        workerQueueRead = (workerQueueRead + numSamples) % queueSize;
+
+        sendWorkerOutputEvents(process->out_events, numSamples);
+
+        // A full list drops events, but never a note off, which would leave the note hanging
+        workerInputEvents.clear();
         auto events = process->in_events;
-        auto numEvents = (int)events->size(events);
-        int currentEvent = 0;
-        int nextEventTime = numSamples;
+        for (uint32_t i = 0; i < events->size(events); ++i)
+        {
+            const auto *event = events->get(events, i);
+            workerInputEvents.push(event, isNoteOff(event));
+        }
+        if (workerInputEvents.numDropped > 0 && processorAsClapProperties)
+            processorAsClapProperties->clap_diagnostics.dropped_input_events.fetch_add(
+                workerInputEvents.numDropped, std::memory_order_relaxed);
+
+        if (process->transport != nullptr)
+            workerTransport = *process->transport;
+        workerProcess.transport = process->transport != nullptr ? &workerTransport : nullptr;
+        workerProcess.steady_time = process->steady_time;
+        workerProcess.frames_count = (uint32_t)numSamples;
+
+        workerJobPending = true;
+        processingWorker->jobReady.signal();
+    }
+
+    /*
+     * The previous job's audio comes out workerLatency samples after its input went in, which
+     * is workerLatency minus that block's length from the start of this host block. Its events
+     * join the delayed list at that offset, and anything falling within this host block goes
+     * out now, while the rest moves over to the other list, timed from the next block.
+     */
+    void sendWorkerOutputEvents(const clap_output_events *ov, int numSamples)
+    {
+        auto &delayed = workerDelayedEvents[workerDelayedIndex];
+        auto &remaining = workerDelayedEvents[1 - workerDelayedIndex];
+
+        const auto outputDelay = workerLatency - (int)workerProcess.frames_count;
+        for (uint32_t i = 0; i < (uint32_t)workerOutputEvents.offsets.size(); ++i)
+        {
+            auto *event = workerOutputEvents.at(i);
+            event->time = (uint32_t)juce::jmax(0, (int)event->time + outputDelay);
+            delayed.push(event);
+        }
+        workerOutputEvents.clear();
 
-        if (numEvents > 0) // get timestamp for first event
+        remaining.clear();
+        for (uint32_t i = 0; i < (uint32_t)delayed.offsets.size(); ++i)
         {
-            auto event = events->get(events, 0);
-            nextEventTime = (int)event->time;
+            auto *event = delayed.at(i);
+            if ((int)event->time < numSamples)
+            {
+                ov->try_push(ov, event);
+            }
+            else
+            {
+                event->time -= (uint32_t)numSamples;
+                remaining.push(event);
+            }
         }
+        delayed.clear();
+        workerDelayedIndex = 1 - workerDelayedIndex;
+    }
 
-        auto processEvent = [&](int sampleOffset) {
-            auto event = events->get(events, (uint32_t)currentEvent);
-            process_clap_event(event, sampleOffset);
+    static bool isNoteOff(const clap_event_header *event)
+    {
+        if (event->space_id != CLAP_CORE_EVENT_SPACE_ID)
+            return false;
+        if (event->type == CLAP_EVENT_NOTE_OFF || event->type == CLAP_EVENT_NOTE_CHOKE)
+            return true;
+        if (event->type != CLAP_EVENT_MIDI)
+            return false;
 
-            currentEvent++;
-            nextEventTime = (currentEvent < numEvents)
-                                ? (int)events->get(events, (uint32_t)currentEvent)->time
-                                : numSamples;
-        };
+        const auto *midi = reinterpret_cast<const clap_event_midi *>(event);
+        const auto status = midi->data[0] & 0xf0;
+        return status == 0x80 || (status == 0x90 && midi->data[2] == 0);
+    }
 
-        /*
-         * OK so here is what JUCE expects in its audio buffer. It *always* uses input as output
-         * buffer so we need to create a buffer where each channel is the channel of the associated
-         * output pointer (fine) and then the inputs need to either check they are the same or copy.
-         */
-        static constexpr uint32_t maxBuses = 128;
-        std::array<float *, maxBuses> busses{};
-        std::array<double *, maxBuses> doubleBusses{};
-        busses.fill(nullptr);
+    void runWorkerJob()
+    {
+        setBlockTransport(workerProcess.transport);
+        (this->*chooseBlockProcessLoop(workerUsesDouble))(&workerProcess);
 
-        bool supportsDouble = processor->supportsDoublePrecisionProcessing();
-        bool hostCalledWithDouble = false;
+        if (workerUsesDouble)
+            queueWorkerOutput(doubleWorkerAudio);
+        else
+            queueWorkerOutput(floatWorkerAudio);
+    }
 
-        if (supportsDouble)
+    template <typename SampleType> void queueWorkerOutput(WorkerAudio<SampleType> &audio)
+    {
+        const auto numSamples = (int)workerProcess.frames_count;
+        const auto queueSize = audio.queue.getNumSamples();
+        const auto firstPart = juce::jmin(numSamples, queueSize - workerQueueWrite);
+        for (int ch = 0; ch < audio.outputs.getNumChannels(); ++ch)
         {
-            doubleBusses.fill(nullptr);
+            const auto *out = audio.outputs.getReadPointer(ch);
+            auto *queued = audio.queue.getWritePointer(ch);
+            juce::FloatVectorOperations::copy(queued + workerQueueWrite, out, firstPart);
+            juce::FloatVectorOperations::copy(queued, out + firstPart, numSamples - firstPart);
         }
+        workerQueueWrite = (workerQueueWrite + numSamples) % queueSize;
+    }
 
-        // we can't advance `n` until we know how many samples we're processing,
-        // so we'll increment it inside the loop.
-        for (int n = 0; n < numSamples;)
+    /** Has the transport jumped, or started playing, since the last block? */
+    bool transportJumped(const clap_event_transport *transport, int numSamples)
+    {
+        const auto isPlaying =
+            transport != nullptr && (transport->flags & CLAP_TRANSPORT_IS_PLAYING) != 0;
+        auto jumped = isPlaying && !transportWasPlaying;
+
+        if (isPlaying && (transport->flags & CLAP_TRANSPORT_HAS_SECONDS_TIMELINE) != 0)
         {
-#if CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES <= 0
-            // Sample-accurate events are turned off, so just process the
-            // whole block.
-            const auto numSamplesToProcess = numSamples;
-#endif
+            const auto samplesToSecTime = (double)CLAP_SECTIME_FACTOR / workerSampleRate;
+            const auto tolerance = (clap_sectime)samplesToSecTime + 1;
+            if (transportWasPlaying &&
+                std::abs(transport->song_pos_seconds - expectedSongPosition) > tolerance)
+                jumped = true;
+            expectedSongPosition =
+                transport->song_pos_seconds + (clap_sectime)(numSamples * samplesToSecTime);
+        }
 
-#if CLAP_ALWAYS_SPLIT_BLOCK && CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES > 0
-            // process a block of the given resolution size, or a smaller block
-            // if there's not enough samples available
-            const auto numSamplesToProcess =
-                juce::jmin(CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES, numSamples - n);
-#endif
+        transportWasPlaying = isPlaying;
+        return jumped;
+    }
 
-#if !CLAP_ALWAYS_SPLIT_BLOCK && CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES > 0
-            const auto numSamplesToProcess = [&]() {
-                const auto samplesUntilEndOfBlock = numSamples - n;
-                const auto samplesUntilNextEvent = [&]() {
-                    for (int eventIndex = currentEvent; eventIndex < numEvents; ++eventIndex)
-                    {
-                        auto event = events->get(events, (uint32_t)eventIndex);
-                        if ((int)event->time < n + CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES)
-                            // this event is within the resolution size, so we don't need to split
-                            continue;
-
-                        if (event->space_id != CLAP_CORE_EVENT_SPACE_ID)
-                            continue; // never split for events that are not in the core namespace
-
-                        // For now we're only splitting the block on parameter events
-                        // so we can get sample-accurate automation, and transport events.
-                        if (event->type == CLAP_EVENT_PARAM_VALUE ||
-                            event->type == CLAP_EVENT_PARAM_MOD ||
-                            event->type == CLAP_EVENT_TRANSPORT)
-                        {
-                            return (int)event->time - n;
-                        }
-                    }
-                    return samplesUntilEndOfBlock;
-                }();
+    std::vector<int> subBlockSizes;
 
-                // the number of samples left is less than
-                // CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES so let's just
-                // process the rest of the block
-                if (samplesUntilEndOfBlock <= CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES)
-                    return samplesUntilEndOfBlock;
+    static bool isSplitEvent(const clap_event_header_t *event)
+    {
+        if (event->space_id != CLAP_CORE_EVENT_SPACE_ID)
+            return false; // never split for events that are not in the core namespace
 
-                // process up until the next event, rounding up to the nearest multiple
-                // of CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES
-                const auto numSmallBlocks =
-                    (samplesUntilNextEvent + CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES - 1) /
-                    CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES;
-                return juce::jmin(numSmallBlocks * CLAP_PROCESS_EVENTS_RESOLUTION_SAMPLES,
-                                  samplesUntilEndOfBlock);
-            }();
-#endif
+        // For now we're only splitting the block on parameter events
+        // so we can get sample-accurate automation, and transport events.
+        return event->type == CLAP_EVENT_PARAM_VALUE || event->type == CLAP_EVENT_PARAM_MOD ||
+               event->type == CLAP_EVENT_TRANSPORT;
+    }
 
-            // process the events in this sub-block
-            while (nextEventTime < n + numSamplesToProcess && currentEvent < numEvents)
-                processEvent(n);
+    void buildSubBlockSchedule(int numSamples, int, SubBlockSplitTag<SubBlockSplit::wholeBlock>)
+    {
+        // Sample-accurate events are turned off, so just process the
+        // whole block.
+        subBlockSizes.clear();
+        subBlockSizes.push_back(numSamples);
+    }
 
-            uint32_t outputChannels = 0;
-            for (uint32_t idx = 0; idx < process->audio_outputs_count && outputChannels < maxBuses;
-                 ++idx)
+    void buildSubBlockSchedule(int numSamples, int resolution,
+                               SubBlockSplitTag<SubBlockSplit::everyResolution>)
+    {
+        // blocks of the given resolution size, whatever the events, and what's left at the end
+        subBlockSizes.clear();
+        for (int n = 0; n < numSamples; n += resolution)
+        {
+            const auto samplesUntilEndOfBlock = numSamples - n;
+            if (samplesUntilEndOfBlock <= resolution ||
+                subBlockSizes.size() + 1 >= subBlockSizes.capacity())
             {
-                for (uint32_t ch = 0; ch < process->audio_outputs[idx].channel_count; ++ch)
-                {
-                    if (supportsDouble && process->audio_outputs[idx].data64 != nullptr)
-                    {
-                        doubleBusses[outputChannels] = process->audio_outputs[idx].data64[ch] + n;
-                        hostCalledWithDouble = true;
-                    }
-                    else
-                    {
-                        busses[outputChannels] = process->audio_outputs[idx].data32[ch] + n;
-                    }
-                    outputChannels++;
-                }
+                subBlockSizes.push_back(samplesUntilEndOfBlock);
+                break;
+            }
+            subBlockSizes.push_back(resolution);
+        }
+    }
+
+    /*
+     * Works out all the sub-block sizes for this block in one pass over the input events.
+     * The split position only ever moves forward, so an event which has been passed over
+     * (because it is within the resolution of a split, or isn't a split event at all)
+     * never needs to be looked at again.
+     */
+    void buildSubBlockSchedule(int numSamples, int resolution,
+                               SubBlockSplitTag<SubBlockSplit::atEvents>)
+    {
+        subBlockSizes.clear();
+        const auto numEvents = blockEvents.size();
+        size_t eventIndex = 0;
+        for (int n = 0; n < numSamples;)
+        {
+            const auto samplesUntilEndOfBlock = numSamples - n;
+
+            // the number of samples left is less than the resolution so let's just process
+            // the rest of the block (or the host handed us more than maxFrameCount and we
+            // have run out of room in the schedule)
+            if (samplesUntilEndOfBlock <= resolution ||
+                subBlockSizes.size() + 1 >= subBlockSizes.capacity())
+            {
+                subBlockSizes.push_back(samplesUntilEndOfBlock);
+                break;
             }
 
-            uint32_t inputChannels = 0;
-            for (uint32_t idx = 0; idx < process->audio_inputs_count && inputChannels < maxBuses;
-                 ++idx)
+            auto samplesUntilNextEvent = samplesUntilEndOfBlock;
+            for (; eventIndex < numEvents; ++eventIndex)
             {
-                for (uint32_t ch = 0; ch < process->audio_inputs[idx].channel_count; ++ch)
+                const auto &event = blockEvents[eventIndex];
+                if (event.time < n + resolution)
+                    continue; // this event is within the resolution size, so we don't need to split
+
+                if (isSplitEvent(event.header))
                 {
-                    if (supportsDouble && process->audio_inputs[idx].data64 != nullptr)
-                    {
-                        auto *ic = process->audio_inputs[idx].data64[ch] + n;
-                        if (inputChannels < outputChannels)
-                        {
-                            if (ic == doubleBusses[inputChannels])
-                            {
-                                // The buffers overlap - no need to do anything
-                            }
-                            else
-                            {
-                                juce::FloatVectorOperations::copy(doubleBusses[inputChannels], ic,
-                                                                  numSamplesToProcess);
-                            }
-                        }
-                        else
-                        {
-                            doubleBusses[inputChannels] = ic;
-                        }
-                        hostCalledWithDouble = true;
-                    }
-                    else
-                    {
-                        auto *ic = process->audio_inputs[idx].data32[ch] + n;
-                        if (inputChannels < outputChannels)
-                        {
-                            if (ic == busses[inputChannels])
-                            {
-                                // The buffers overlap - no need to do anything
-                            }
-                            else
-                            {
-                                juce::FloatVectorOperations::copy(busses[inputChannels], ic,
-                                                                  numSamplesToProcess);
-                            }
-                        }
-                        else
-                        {
-                            busses[inputChannels] = ic;
-                        }
-                    }
-                    inputChannels++;
+                    samplesUntilNextEvent = event.time - n;
+                    break;
                 }
             }
 
-            auto totalChans = juce::jmax(inputChannels, outputChannels);
-            if (hostCalledWithDouble)
+            // process up until the next event, rounding up to the nearest multiple
+            // of the resolution
+            const auto numSmallBlocks = (samplesUntilNextEvent + resolution - 1) / resolution;
+            const auto subBlockSize =
+                juce::jmin(numSmallBlocks * resolution, samplesUntilEndOfBlock);
+            subBlockSizes.push_back(subBlockSize);
+            n += subBlockSize;
+        }
+    }
+
+    int64_t sleepAfterSilentSamples{0};
+    int64_t silentInputSamples{0};
+
+    /** Has the host flagged every input channel as constant silence? */
+    static bool inputsAreSilent(const clap_process *process)
+    {
+        for (uint32_t idx = 0; idx < process->audio_inputs_count; ++idx)
+        {
+            const auto &input = process->audio_inputs[idx];
+            if (input.channel_count == 0)
+                continue;
+            if (input.channel_count > 64)
+                return false; // the constant mask can't describe these channels
+
+            const auto allChannels = input.channel_count == 64
+                                         ? ~(uint64_t)0
+                                         : ((uint64_t)1 << input.channel_count) - 1;
+            if ((input.constant_mask & allChannels) != allChannels)
+                return false;
+
+            // constant doesn't mean silent, so check the value
+            for (uint32_t ch = 0; ch < input.channel_count; ++ch)
             {
-                juce::AudioBuffer<double> buffer(doubleBusses.data(), (int)totalChans,
-                                                 numSamplesToProcess);
+                JUCE_BEGIN_IGNORE_WARNINGS_GCC_LIKE("-Wfloat-equal")
+                const auto isZero = input.data64 != nullptr ? input.data64[ch][0] == 0.0
+                                                            : input.data32[ch][0] == 0.0f;
+                JUCE_END_IGNORE_WARNINGS_GCC_LIKE
+                if (!isZero)
+                    return false;
+            }
+        }
+        return true;
+    }
 
-                if (processor->isSuspended())
-                {
-                    buffer.clear();
-                }
-                else
+    static void clearOutputs(const clap_process *process)
+    {
+        const auto numSamples = process->frames_count;
+        for (uint32_t idx = 0; idx < process->audio_outputs_count; ++idx)
+        {
+            auto &output = process->audio_outputs[idx];
+            for (uint32_t ch = 0; ch < output.channel_count; ++ch)
+            {
+                if (output.data64 != nullptr)
+                    juce::FloatVectorOperations::clear(output.data64[ch], (int)numSamples);
+                else if (output.data32 != nullptr)
+                    juce::FloatVectorOperations::clear(output.data32[ch], (int)numSamples);
+            }
+            output.constant_mask = ~(uint64_t)0;
+        }
+    }
+
+    /** Sets the constant_mask bit for every output channel which holds a single value. */
+    void markConstantOutputs(const clap_process *process, bool hostCalledWithDouble)
+    {
+        const auto numSamples = (int)process->frames_count;
+        uint64_t numConstant = 0;
+        for (uint32_t idx = 0; idx < process->audio_outputs_count; ++idx)
+        {
+            auto &output = process->audio_outputs[idx];
+            uint64_t mask = 0;
+
+            // channels past 64 can't be described by the mask, so leave them unflagged
+            const auto numChannels = juce::jmin(output.channel_count, (uint32_t)64);
+            for (uint32_t ch = 0; ch < numChannels; ++ch)
+            {
+                const auto constant = hostCalledWithDouble
+                                          ? isConstant(output.data64[ch], numSamples)
+                                          : isConstant(output.data32[ch], numSamples);
+                if (constant)
                 {
-                    FIXME("Handle bypass and deactivated states")
-                    processor->processBlock(buffer, midiBuffer);
+                    mask |= (uint64_t)1 << ch;
+                    ++numConstant;
                 }
             }
-            else
+            output.constant_mask = mask;
+        }
+
+        if (processorAsClapProperties && numConstant > 0)
+            processorAsClapProperties->clap_diagnostics.constant_output_channels.fetch_add(
+                numConstant, std::memory_order_relaxed);
+    }
+
+    static bool hostProvidesDoubleBuffers(const clap_process *process)
+    {
+        // CLAP_AUDIO_PORT_REQUIRES_COMMON_SAMPLE_SIZE means the first populated port tells us
+        for (uint32_t idx = 0; idx < process->audio_outputs_count; ++idx)
+            if (process->audio_outputs[idx].channel_count > 0)
+                return process->audio_outputs[idx].data64 != nullptr;
+        for (uint32_t idx = 0; idx < process->audio_inputs_count; ++idx)
+            if (process->audio_inputs[idx].channel_count > 0)
+                return process->audio_inputs[idx].data64 != nullptr;
+        return false;
+    }
+
+    static float *const *getHostChannelData(const clap_audio_buffer &buffer, float *)
+    {
+        return buffer.data32;
+    }
+    static double *const *getHostChannelData(const clap_audio_buffer &buffer, double *)
+    {
+        return buffer.data64;
+    }
+
+    /*
+     * Resolves the routing plan against this block's host buffers. Anything the host
+     * didn't give us (which would be a host bug) is pointed at wrapper scratch instead.
+     */
+    template <typename SampleType>
+    void bindHostChannels(const clap_process *process, ChannelPointers<SampleType> &pointers)
+    {
+        auto bind = [&pointers](const clap_audio_buffer *buffers, uint32_t count,
+                                const std::vector<ChannelRoute> &routes,
+                                std::vector<SampleType *> &dest, int scratchOffset) {
+            for (size_t i = 0; i < routes.size(); ++i)
             {
-                juce::AudioBuffer<float> buffer(busses.data(), (int)totalChans,
-                                                numSamplesToProcess);
+                const auto &route = routes[i];
+                SampleType *const *data = nullptr;
+                if (route.port < count && route.channel < buffers[route.port].channel_count)
+                    data = getHostChannelData(buffers[route.port], (SampleType *)nullptr);
 
-                if (processor->isSuspended())
+                if (data != nullptr && data[route.channel] != nullptr)
                 {
-                    buffer.clear();
+                    dest[i] = data[route.channel];
                 }
                 else
                 {
-                    FIXME("Handle bypass and deactivated states")
-                    processor->processBlock(buffer, midiBuffer);
+                    jassertfalse; // the host didn't provide a port or channel we advertised
+                    auto scratchChannel = scratchOffset + (int)i;
+                    pointers.unroutedScratch.clear(scratchChannel, 0,
+                                                   pointers.unroutedScratch.getNumSamples());
+                    dest[i] = pointers.unroutedScratch.getWritePointer(scratchChannel);
                 }
             }
+        };
+
+        bind(process->audio_outputs, process->audio_outputs_count, outputChannelRoutes,
+             pointers.outputs, 0);
+        bind(process->audio_inputs, process->audio_inputs_count, inputChannelRoutes,
+             pointers.inputs, (int)outputChannelRoutes.size());
+
+        // Channels which the host is already processing in place (see in_place_pair in
+        // audioPortsInfo) are handed to JUCE as they are. An input sharing memory with any other
+        // output channel, on whichever port, would be written over before we read it, so
+        // those are saved for the whole block before anything is written.
+        const auto numFrames = (int)process->frames_count;
+        const auto &outputs = pointers.outputs;
+        for (size_t i = 0; i < pointers.inputs.size(); ++i)
+        {
+            const auto inPlace = i < outputs.size() && pointers.inputs[i] == outputs[i];
+            if (i < pointers.inPlace.size())
+                pointers.inPlace[i] = inPlace ? 1 : 0;
 
-            if (processorAsClapExtensions && processorAsClapExtensions->supportsOutboundEvents())
+            if (!inPlace &&
+                std::find(outputs.begin(), outputs.end(), pointers.inputs[i]) != outputs.end())
             {
-                processorAsClapExtensions->addOutboundEventsToQueue(process->out_events, midiBuffer,
-                                                                    n);
+                auto *saved = pointers.aliasedInputScratch.getWritePointer((int)i);
+                juce::FloatVectorOperations::copy(saved, pointers.inputs[i], numFrames);
+                pointers.inputs[i] = saved;
             }
-            else if (processor->producesMidi())
+        }
+    }
+
+    /*
+     * Only the loop which runs the processor straight on the host buffers can use in-place
+     * pairs. Converting precision, the fixed block and the worker copy every channel, so
+     * they don't count towards the diagnostics.
+     */
+    template <typename HostType, typename ProcessType>
+    void countSharedChannels(const ChannelPointers<HostType> &, ProcessType *)
+    {
+    }
+
+    template <typename SampleType>
+    void countSharedChannels(const ChannelPointers<SampleType> &pointers, SampleType *)
+    {
+        if (!processorAsClapProperties || processingWorker != nullptr)
+            return;
+
+        const auto numAliased =
+            (uint64_t)std::count(pointers.inPlace.begin(), pointers.inPlace.end(), 1);
+        auto &diagnostics = processorAsClapProperties->clap_diagnostics;
+        diagnostics.aliased_channels.fetch_add(numAliased, std::memory_order_relaxed);
+        diagnostics.copied_channels.fetch_add((uint64_t)pointers.inputs.size() - numAliased,
+                                              std::memory_order_relaxed);
+    }
+
+    /*
+     * OK so here is what JUCE expects in its audio buffer. It *always* uses input as output
+     * buffer so we need to create a buffer where each channel is the channel of the associated
+     * output pointer (fine) and then the inputs need to either check they are the same or copy.
+     * Input channels without an output to land in are copied to scratch, since processBlock
+     * is free to write over them and the host's input buffers aren't ours to write to.
+     */
+    template <typename SampleType>
+    void processSubBlock(ChannelPointers<SampleType> &pointers, int sampleOffset, int numSamples)
+    {
+        const auto numOutputs = pointers.outputs.size();
+        for (size_t i = 0; i < numOutputs; ++i)
+            pointers.buffer[i] = pointers.outputs[i] + sampleOffset;
+
+        for (size_t i = 0; i < pointers.inputs.size(); ++i)
+        {
+            auto *ic = pointers.inputs[i] + sampleOffset;
+            if (i < numOutputs)
             {
-                for (auto meta : midiBuffer)
-                {
-                    auto msg = meta.getMessage();
-                    auto msgSize = msg.getRawDataSize();
-                    if (msgSize == 2 || msgSize == 3)
-                    {
-                        auto evt = clap_event_midi();
-                        evt.header.size = sizeof(clap_event_midi);
-                        evt.header.type = (uint16_t)CLAP_EVENT_MIDI;
-                        evt.header.time = uint32_t(meta.samplePosition + n);
-                        evt.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
-                        evt.header.flags = 0;
-                        evt.port_index = 0;
-                        memcpy(&evt.data, msg.getRawData(), static_cast<size_t>(msgSize) * sizeof(uint8_t));
-                        if (msgSize == 2) {
-                          evt.data[2] = 0;
-                        }
-                        ov->try_push(ov, reinterpret_cast<const clap_event_header *>(&evt));
-                    }
-                }
+                if (!pointers.inPlace[i]) // if the buffers overlap there is nothing to do
+                    juce::FloatVectorOperations::copy(pointers.buffer[i], ic, numSamples);
+            }
+            else
+            {
+                auto *scratch = pointers.inputOnlyScratch.getWritePointer((int)(i - numOutputs));
+                juce::FloatVectorOperations::copy(scratch, ic, numSamples);
+                pointers.buffer[i] = scratch;
             }
+        }
 
-            if (!midiBuffer.isEmpty())
-                midiBuffer.clear();
+        const auto numChannels = juce::jmax(numOutputs, pointers.inputs.size());
+        auto &buffer = getProcessBuffer((SampleType *)nullptr);
+        pointProcessBuffer(buffer, pointers.buffer.data(), (int)numChannels, numSamples);
+        runProcessBlock(buffer);
+    }
 
-            n += numSamplesToProcess;
+    /*
+     * The mixed precision version of processSubBlock: the processor runs on a scratch buffer
+     * in its own precision, and we convert the host's inputs in and the outputs back out.
+     */
+    template <typename HostType, typename ProcessType>
+    void processConvertedSubBlock(ChannelPointers<HostType> &pointers,
+                                  juce::AudioBuffer<ProcessType> &scratch, int sampleOffset,
+                                  int numSamples)
+    {
+        const auto numInputs = pointers.inputs.size();
+        const auto numOutputs = pointers.outputs.size();
+        const auto numChannels = juce::jmax(numInputs, numOutputs);
+        jassert((int)numChannels <= scratch.getNumChannels());
+        jassert(numSamples <= scratch.getNumSamples());
+
+        for (size_t i = 0; i < numChannels; ++i)
+        {
+            auto *dest = scratch.getWritePointer((int)i);
+            if (i < numInputs)
+                convertSamples(dest, pointers.inputs[i] + sampleOffset, numSamples);
+            else
+                juce::FloatVectorOperations::clear(dest, numSamples);
         }
 
-        // process any leftover events
-        while (currentEvent < numEvents)
-            processEvent(numSamples);
+        auto &buffer = getProcessBuffer((ProcessType *)nullptr);
+        pointProcessBuffer(buffer, scratch.getArrayOfWritePointers(), (int)numChannels,
+                           numSamples);
+        runProcessBlock(buffer);
 
-        return CLAP_PROCESS_CONTINUE;
+        for (size_t i = 0; i < numOutputs; ++i)
+            convertSamples(pointers.outputs[i] + sampleOffset, scratch.getReadPointer((int)i),
+                           numSamples);
     }
 
-    void paramsFlush(const clap_input_events *in, const clap_output_events *out) noexcept override
+    juce::AudioBuffer<float> &getProcessBuffer(float *) { return floatProcessBuffer; }
+    juce::AudioBuffer<double> &getProcessBuffer(double *) { return doubleProcessBuffer; }
+
+    /*
+     * A juce::AudioBuffer copies the channel pointers it's given into its own array, which
+     * setDataToReferTo() and the constructors allocate from 32 channels up. So processBlock
+     * gets one of two buffers which own memory for every channel of the largest block, sized
+     * at activation. A sub-block of a different length only resizes it within that memory,
+     * which keeps its channel array, and then the array is pointed at the real channels.
+     */
+    template <typename SampleType, typename ChannelArray>
+    static void pointProcessBuffer(juce::AudioBuffer<SampleType> &buffer,
+                                   ChannelArray channels, int numChannels, int numSamples)
     {
-        pushUIQueueToOutputEvents(out);
+        // JUCE 7 hands the array out as const, but it's the buffer's own writable array.
+        // Asking for it also tells the buffer it isn't clear, which it shouldn't assume of
+        // the channels it's about to be given, and stops setSize() clearing its own memory.
+        auto **dest = const_cast<SampleType **>(buffer.getArrayOfWritePointers());
+        if (buffer.getNumChannels() != numChannels || buffer.getNumSamples() != numSamples)
+        {
+            buffer.setSize(numChannels, numSamples, false, false, true);
+            dest = const_cast<SampleType **>(buffer.getArrayOfWritePointers());
+        }
 
-        if (processorAsClapExtensions)
+        for (int i = 0; i < numChannels; ++i)
+            dest[i] = channels[i];
+    }
+
+    template <typename SampleType> void runProcessBlock(juce::AudioBuffer<SampleType> &buffer)
+    {
+        if (processor->isSuspended())
+            buffer.clear();
+        else if (bypassParameter != nullptr)
+            processBlockWithBypass(buffer, getBypassDelay((SampleType *)nullptr));
+        else
+            processor->processBlock(buffer, midiBuffer);
+    }
+
+    /*
+     * Wrapper level bypass. While bypassed we don't call processBlock at all, and the outputs
+     * carry the inputs delayed by the processor latency, so they stay aligned with what the
+     * host compensates for. Engaging or releasing the bypass crossfades between the two,
+     * starting at the sample of the bypass parameter event. The dry signal goes through the
+     * delay on every block, so it is ready the moment the bypass is engaged.
+     */
+    template <typename SampleType> struct BypassDelay
+    {
+        juce::AudioBuffer<SampleType> ring; // latency + maxFrameCount samples
+        juce::AudioBuffer<SampleType> dry;  // the delayed input for the current sub-block
+        int writePosition{0};
+    };
+    juce::AudioProcessorParameter *bypassParameter{nullptr};
+    clap_id bypassClapID{0};
+    BypassDelay<float> floatBypassDelay;
+    BypassDelay<double> doubleBypassDelay;
+    std::vector<float> bypassGains;
+    int bypassLatency{0}, bypassFadeSamples{1};
+    int bypassDryChannels{0}, bypassOutputChannels{0};
+    bool bypassEngaged{false};
+    float bypassMix{0.0f}; // 0 is fully processed, 1 is fully bypassed
+    int pendingBypassOffset{-1}; // sub-block offset of the bypass event, if we have seen one
+
+    BypassDelay<float> &getBypassDelay(float *) { return floatBypassDelay; }
+    BypassDelay<double> &getBypassDelay(double *) { return doubleBypassDelay; }
+
+    bool isBypassParameterOn() const { return bypassParameter->getValue() >= 0.5f; }
+
+    void prepareBypass(double sampleRate, int maxFrameCount)
+    {
+        floatBypassDelay = {};
+        doubleBypassDelay = {};
+        bypassGains.clear();
+        pendingBypassOffset = -1;
+        if (bypassParameter == nullptr)
+            return;
+
+        bypassEngaged = isBypassParameterOn();
+        bypassMix = bypassEngaged ? 1.0f : 0.0f;
+        bypassLatency = juce::jmax(0, processor->getLatencySamples());
+        bypassFadeSamples = juce::jmax(1, juce::roundToInt(sampleRate * 0.01));
+        bypassDryChannels =
+            (int)juce::jmin(inputChannelRoutes.size(), outputChannelRoutes.size());
+        bypassOutputChannels = (int)outputChannelRoutes.size();
+        bypassGains.resize((size_t)maxFrameCount);
+
+        auto prepareDelay = [&](auto &delay) {
+            delay.ring.setSize(bypassDryChannels, bypassLatency + maxFrameCount);
+            delay.ring.clear();
+            delay.dry.setSize(bypassDryChannels, maxFrameCount);
+        };
+        if (!processesInDouble(false))
+            prepareDelay(floatBypassDelay);
+        if (processesInDouble(supportsDoubleHostBuffers()))
+            prepareDelay(doubleBypassDelay);
+    }
+
+    template <typename SampleType>
+    void processBlockWithBypass(juce::AudioBuffer<SampleType> &buffer,
+                                BypassDelay<SampleType> &delay)
+    {
+        const auto numSamples = buffer.getNumSamples();
+        jassert(numSamples <= delay.dry.getNumSamples());
+
+        const auto wasEngaged = bypassEngaged;
+        bypassEngaged = isBypassParameterOn();
+        const auto changeOffset = juce::jlimit(0, numSamples, pendingBypassOffset);
+        pendingBypassOffset = -1;
+
+        // before processing, since the processor may well be working in place
+        const auto readPosition = writeBypassDelay(buffer, delay);
+
+        if (!wasEngaged && !bypassEngaged && bypassMix <= 0.0f)
         {
-            if (processorAsClapExtensions->supportsDirectParamsFlush())
+            processor->processBlock(buffer, midiBuffer);
+            return;
+        }
+
+        readBypassDelay(delay, readPosition, numSamples);
+
+        if (wasEngaged && bypassEngaged && bypassMix >= 1.0f)
+        {
+            // fully bypassed, so the processor is skipped and MIDI passes through untouched
+            for (int ch = 0; ch < bypassOutputChannels; ++ch)
             {
-                processorAsClapExtensions->clap_direct_paramsFlush(in, out);
-                return;
+                if (ch < bypassDryChannels)
+                    buffer.copyFrom(ch, 0, delay.dry, ch, 0, numSamples);
+                else
+                    buffer.clear(ch, 0, numSamples);
+            }
+            return;
+        }
+
+        processor->processBlock(buffer, midiBuffer);
+
+        // until the event the previous fade carries on, after it we head to the new state
+        const auto step = 1.0f / (float)bypassFadeSamples;
+        auto mix = bypassMix;
+        for (int i = 0; i < numSamples; ++i)
+        {
+            const auto engaged = i < changeOffset ? wasEngaged : bypassEngaged;
+            mix = engaged ? juce::jmin(1.0f, mix + step) : juce::jmax(0.0f, mix - step);
+            bypassGains[(size_t)i] = mix;
+        }
+        bypassMix = mix;
+
+        for (int ch = 0; ch < bypassOutputChannels; ++ch)
+        {
+            auto *out = buffer.getWritePointer(ch);
+            const auto *dry = ch < bypassDryChannels ? delay.dry.getReadPointer(ch) : nullptr;
+            for (int i = 0; i < numSamples; ++i)
+            {
+                const auto drySample = dry != nullptr ? dry[i] : SampleType(0);
+                out[i] += (drySample - out[i]) * (SampleType)bypassGains[(size_t)i];
             }
         }
+    }
+
+    /** Pushes the sub-block inputs into the delay, returning where the delayed input starts. */
+    template <typename SampleType>
+    int writeBypassDelay(const juce::AudioBuffer<SampleType> &buffer,
+                         BypassDelay<SampleType> &delay)
+    {
+        const auto numSamples = buffer.getNumSamples();
+        const auto ringSize = delay.ring.getNumSamples();
+        const auto writePosition = delay.writePosition;
+        const auto firstPart = juce::jmin(numSamples, ringSize - writePosition);
+        for (int ch = 0; ch < bypassDryChannels; ++ch)
+        {
+            const auto *in = buffer.getReadPointer(ch);
+            auto *ring = delay.ring.getWritePointer(ch);
+            juce::FloatVectorOperations::copy(ring + writePosition, in, firstPart);
+            juce::FloatVectorOperations::copy(ring, in + firstPart, numSamples - firstPart);
+        }
+        delay.writePosition = (writePosition + numSamples) % ringSize;
+
+        const auto readPosition = writePosition - bypassLatency;
+        return readPosition < 0 ? readPosition + ringSize : readPosition;
+    }
+
+    template <typename SampleType>
+    void readBypassDelay(BypassDelay<SampleType> &delay, int readPosition, int numSamples)
+    {
+        const auto firstPart = juce::jmin(numSamples, delay.ring.getNumSamples() - readPosition);
+        for (int ch = 0; ch < bypassDryChannels; ++ch)
+        {
+            const auto *ring = delay.ring.getReadPointer(ch);
+            auto *dry = delay.dry.getWritePointer(ch);
+            juce::FloatVectorOperations::copy(dry, ring + readPosition, firstPart);
+            juce::FloatVectorOperations::copy(dry + firstPart, ring, numSamples - firstPart);
+        }
+    }
+
+    void paramsFlush(const clap_input_events *in, const clap_output_events *out) noexcept override
+    {
+        // the events below touch the same state as the worker's process loop
+        waitForWorker();
+        pushUIQueueToOutputEvents(out);
+
+        if (capabilities.directParamsFlush)
+        {
+            processorAsClapExtensions->clap_direct_paramsFlush(in, out);
+            return;
+        }
 
         uint32_t sz = in->size(in);
         for (uint32_t i = 0; i < sz; ++i)
@@ -1867,6 +4702,7 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
             auto ev = in->get(in, i);
             process_clap_event(ev, 0); // 0 since there is no block decomp in flush
         }
+        applyPendingParamChanges();
     }
 
     void pushUIQueueToOutputEvents(const clap_output_events_t *ov)
@@ -1901,12 +4737,32 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
             }
         }
     }
+    // for flush(), which has no process loop to say whether the processor takes MIDI
     void process_clap_event(const clap_event_header_t *event, int sampleOffset)
     {
-        if (processorAsClapExtensions &&
-            processorAsClapExtensions->supportsDirectEvent(event->space_id, event->type))
+        if (capabilities.acceptsMidi)
+            process_clap_event(event, sampleOffset, MidiInputTag<MidiInput::midiBuffer>{});
+        else
+            process_clap_event(event, sampleOffset, MidiInputTag<MidiInput::none>{});
+    }
+
+    void addMidiInput(const uint8_t *, int, int, MidiInputTag<MidiInput::none>) {}
+
+    void addMidiInput(const uint8_t *data, int numBytes, int sampleOffset,
+                      MidiInputTag<MidiInput::midiBuffer>)
+    {
+        midiBuffer.addEvent(data, numBytes, sampleOffset);
+    }
+
+    template <MidiInput midiInput>
+    void process_clap_event(const clap_event_header_t *event, int sampleOffset,
+                            MidiInputTag<midiInput>)
+    {
+        if (handlesEventDirectly(event))
         {
-            // the plugin wants to handle this event with some custom logic
+            // the plugin wants to handle this event with some custom logic, and may read
+            // parameters while it does, so they get the changes queued before this event
+            applyPendingParamChanges();
             processorAsClapExtensions->handleDirectEvent(event, sampleOffset);
             return;
         }
@@ -1914,39 +4770,54 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         if (event->space_id != CLAP_CORE_EVENT_SPACE_ID)
             return;
 
+        // MIDI goes into the buffer as raw bytes, without building a juce::MidiMessage
+        // (which allocates for sysex), and not at all if the processor doesn't take MIDI
         switch (event->type)
         {
         case CLAP_EVENT_NOTE_ON:
+        case CLAP_EVENT_NOTE_OFF:
         {
             auto noteEvent = reinterpret_cast<const clap_event_note *>(event);
-
-            midiBuffer.addEvent(juce::MidiMessage::noteOn(noteEvent->channel + 1, noteEvent->key,
-                                                          (float)noteEvent->velocity),
-                                (int)noteEvent->header.time - sampleOffset);
+            if (noteEvent->channel < 0 || noteEvent->key < 0)
+                break; // no MIDI equivalent for wildcard notes
+
+            const auto isNoteOn = event->type == CLAP_EVENT_NOTE_ON;
+            const auto time = (int)noteEvent->header.time - sampleOffset;
+            auto channel = noteEvent->channel & 0x0f;
+            if (capabilities.noteExpressionsToMpe)
+                channel = isNoteOn ? startMpeNote(noteEvent, time) : stopMpeNote(noteEvent);
+            if (channel < 0)
+                break; // its member channel went to a newer note, which ended this one
+
+            // the processor reports note ends on the channel it saw the note on
+            if (isNoteOn && capabilities.noteEndTracking)
+                trackNoteOn(noteEvent->note_id, noteEvent->port_index, channel, noteEvent->key);
+
+            const uint8_t data[3] = {
+                (uint8_t)((isNoteOn ? 0x90 : 0x80) | channel), (uint8_t)(noteEvent->key & 0x7f),
+                juce::MidiMessage::floatValueToMidiByte((float)noteEvent->velocity)};
+            addMidiInput(data, 3, time, MidiInputTag<midiInput>{});
         }
         break;
-        case CLAP_EVENT_NOTE_OFF:
+        case CLAP_EVENT_NOTE_CHOKE:
         {
-            auto noteEvent = reinterpret_cast<const clap_event_note *>(event);
-            midiBuffer.addEvent(juce::MidiMessage::noteOff(noteEvent->channel + 1, noteEvent->key,
-                                                           (float)noteEvent->velocity),
-                                (int)noteEvent->header.time - sampleOffset);
+            chokeNotes(reinterpret_cast<const clap_event_note *>(event),
+                       (int)event->time - sampleOffset);
         }
         break;
         case CLAP_EVENT_MIDI:
         {
             auto midiEvent = reinterpret_cast<const clap_event_midi *>(event);
-            midiBuffer.addEvent(juce::MidiMessage(midiEvent->data[0], midiEvent->data[1],
-                                                  midiEvent->data[2], midiEvent->header.time),
-                                (int)midiEvent->header.time - sampleOffset);
+            addMidiInput(midiEvent->data, 3, (int)midiEvent->header.time - sampleOffset,
+                         MidiInputTag<midiInput>{});
         }
         break;
         case CLAP_EVENT_MIDI_SYSEX:
         {
             auto midiSysexEvent = reinterpret_cast<const clap_event_midi_sysex *>(event);
-            midiBuffer.addEvent(juce::MidiMessage(midiSysexEvent->buffer, (int)midiSysexEvent->size,
-                                                  midiSysexEvent->header.time),
-                                (int)midiSysexEvent->header.time - sampleOffset);
+            addMidiInput(midiSysexEvent->buffer, (int)midiSysexEvent->size,
+                         (int)midiSysexEvent->header.time - sampleOffset,
+                         MidiInputTag<midiInput>{});
         }
         break;
         case CLAP_EVENT_TRANSPORT:
@@ -1957,7 +4828,22 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
         case CLAP_EVENT_PARAM_VALUE:
         {
             auto paramEvent = reinterpret_cast<const clap_event_param_value *>(event);
-            handleParameterChangeEvent(paramEvent);
+            auto *param = static_cast<JUCEParameterVariant *>(paramEvent->cookie);
+            if (param == nullptr) // unlikely
+                param = findVariantByParamId(paramEvent->param_id);
+
+            if (auto *pending = param != nullptr ? getPendingParamChange(*param) : nullptr)
+            {
+                pending->value = paramEvent->value;
+                pending->hasValue = true;
+            }
+            else
+            {
+                handleParameterChangeEvent(paramEvent);
+            }
+
+            if (bypassParameter != nullptr && paramEvent->param_id == bypassClapID)
+                pendingBypassOffset = juce::jmax(0, (int)event->time - sampleOffset);
         }
         break;
         case CLAP_EVENT_PARAM_MOD:
@@ -1999,7 +4885,15 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
                         return;
                     }
 
-                    modulatableParam->applyMonophonicModulation(paramModEvent->amount);
+                    if (auto *pending = getPendingParamChange(*parameterVariant))
+                    {
+                        pending->modAmount = paramModEvent->amount;
+                        pending->hasMod = true;
+                    }
+                    else
+                    {
+                        modulatableParam->applyMonophonicModulation(paramModEvent->amount);
+                    }
                 }
             }
             else
@@ -2015,6 +4909,14 @@ class ClapJuceWrapper : public clap::helpers::Plugin<
             // Why do you send me this, Alex?
         }
         break;
+        case CLAP_EVENT_NOTE_EXPRESSION:
+        {
+            // plugins which handle expressions themselves get them through handleDirectEvent
+            if (capabilities.noteExpressionsToMpe)
+                sendMpeExpression(reinterpret_cast<const clap_event_note_expression *>(event),
+                                  (int)event->time - sampleOffset);
+        }
+        break;
         default:
         {
             DBG("Unknown CLAP Event type " << (int)event->type);
@@ -0,0 +1,19 @@
+#include "SplitTestPlugin.h"
+
+SplitTestPlugin::SplitTestPlugin()
+    : juce::AudioProcessor(
+          BusesProperties().withOutput("Output", juce::AudioChannelSet::stereo(), true))
+{
+    addParameter(level = new juce::AudioParameterFloat("level", "Level", 0.0f, 1.0f, 1.0f));
+}
+
+void SplitTestPlugin::processBlock(juce::AudioBuffer<float> &buffer, juce::MidiBuffer &)
+{
+    const auto value = level->get();
+    for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+        juce::FloatVectorOperations::fill(buffer.getWritePointer(ch), value,
+                                          buffer.getNumSamples());
+}
+
+// This creates new instances of the plugin
+juce::AudioProcessor *JUCE_CALLTYPE createPluginFilter() { return new SplitTestPlugin(); }
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <juce_audio_processors/juce_audio_processors.h>
+
+/*
+ * The cheapest processor which still sees every parameter change: it writes its one parameter,
+ * a level, to every output sample. Built with a one sample event resolution, so each host
+ * parameter event starts a sub-block of its own, tests/host/clap-test-host times what the
+ * wrapper's split and process loop cost per event with next to nothing else in process().
+ */
+class SplitTestPlugin : public juce::AudioProcessor
+{
+  public:
+    SplitTestPlugin();
+
+    const juce::String getName() const override { return JucePlugin_Name; }
+    bool acceptsMidi() const override { return false; }
+    bool producesMidi() const override { return false; }
+    bool isMidiEffect() const override { return false; }
+
+    double getTailLengthSeconds() const override { return 0.0; }
+
+    int getNumPrograms() override { return 1; }
+    int getCurrentProgram() override { return 0; }
+    void setCurrentProgram(int) override {}
+    const juce::String getProgramName(int) override { return juce::String(); }
+    void changeProgramName(int, const juce::String &) override {}
+
+    void prepareToPlay(double, int) override {}
+    void releaseResources() override {}
+    void processBlock(juce::AudioBuffer<float> &, juce::MidiBuffer &) override;
+    void processBlock(juce::AudioBuffer<double> &, juce::MidiBuffer &) override {}
+
+    bool hasEditor() const override { return false; }
+    juce::AudioProcessorEditor *createEditor() override { return nullptr; }
+
+    void getStateInformation(juce::MemoryBlock &) override {}
+    void setStateInformation(const void *, int) override {}
+
+  private:
+    juce::AudioParameterFloat *level{nullptr};
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SplitTestPlugin)
+};
@@ -0,0 +1,141 @@
+#include "StressTestPlugin.h"
+
+namespace
+{
+constexpr float voiceLevel = 0.001f;
+}
+
+StressTestPlugin::StressTestPlugin()
+    : juce::AudioProcessor(
+          BusesProperties().withOutput("Output", juce::AudioChannelSet::stereo(), true))
+{
+    voices.resize(maxVoices);
+    voiceEndedAt.resize(maxVoices, -1);
+    taskMixes.resize(numTasks);
+}
+
+void StressTestPlugin::prepareToPlay(double, int samplesPerBlock)
+{
+    for (auto &taskMix : taskMixes)
+        taskMix.assign((size_t)samplesPerBlock, 0.0f);
+    std::fill(voices.begin(), voices.end(), Voice{});
+    nextVoiceAge = 0;
+}
+
+void StressTestPlugin::startVoice(int channel, int key, int sampleOffset)
+{
+    for (auto &voice : voices)
+    {
+        if (voice.key >= 0)
+            continue;
+
+        voice = Voice{};
+        voice.channel = channel;
+        voice.key = key;
+        voice.age = nextVoiceAge++;
+        voice.angleDelta = juce::MathConstants<double>::twoPi *
+                           juce::MidiMessage::getMidiNoteInHertz(key) / getSampleRate();
+        voice.startAt = sampleOffset;
+        return;
+    }
+    jassertfalse; // out of voices
+}
+
+void StressTestPlugin::releaseVoice(int channel, int key, int sampleOffset)
+{
+    Voice *oldest = nullptr;
+    for (auto &voice : voices)
+        if (voice.key == key && voice.channel == channel && !voice.released &&
+            voice.releaseAt < 0 && (oldest == nullptr || voice.age < oldest->age))
+            oldest = &voice;
+
+    if (oldest != nullptr)
+        oldest->releaseAt = sampleOffset;
+}
+
+int StressTestPlugin::renderVoice(Voice &voice, float *out, int numSamples)
+{
+    for (int i = voice.startAt; i < numSamples; ++i)
+    {
+        if (i == voice.releaseAt)
+        {
+            voice.released = true;
+            voice.releaseLeft = releaseSamples;
+        }
+
+        auto gain = voiceLevel;
+        if (voice.released)
+        {
+            if (voice.releaseLeft == 0)
+                return i;
+            gain *= (float)voice.releaseLeft-- / (float)releaseSamples;
+        }
+
+        out[i] += gain * (float)std::sin(voice.angle);
+        voice.angle += voice.angleDelta;
+        if (voice.angle >= juce::MathConstants<double>::twoPi)
+            voice.angle -= juce::MathConstants<double>::twoPi;
+    }
+    return -1;
+}
+
+void StressTestPlugin::parallelTaskExecute(uint32_t taskIndex)
+{
+    auto &taskMix = taskMixes[taskIndex];
+    std::fill(taskMix.begin(), taskMix.begin() + taskBlockSize, 0.0f);
+
+    // voices are dealt out to the tasks in turn, since the pool fills up from the front
+    for (auto v = (int)taskIndex; v < maxVoices; v += numTasks)
+    {
+        auto &voice = voices[(size_t)v];
+        voiceEndedAt[(size_t)v] =
+            voice.key >= 0 ? renderVoice(voice, taskMix.data(), taskBlockSize) : -1;
+    }
+}
+
+void StressTestPlugin::processBlock(juce::AudioBuffer<float> &buffer, juce::MidiBuffer &midi)
+{
+    const auto numSamples = buffer.getNumSamples();
+    if (numSamples > (int)taskMixes[0].size())
+    {
+        jassertfalse; // bigger than the block we were prepared for
+        buffer.clear();
+        return;
+    }
+
+    for (auto &voice : voices)
+    {
+        voice.startAt = 0;
+        voice.releaseAt = -1;
+    }
+
+    for (const auto meta : midi)
+    {
+        const auto message = meta.getMessage();
+        if (message.isNoteOn())
+            startVoice(message.getChannel(), message.getNoteNumber(), meta.samplePosition);
+        else if (message.isNoteOff())
+            releaseVoice(message.getChannel(), message.getNoteNumber(), meta.samplePosition);
+    }
+
+    taskBlockSize = numSamples;
+    submitParallelTasks(numTasks);
+
+    // reportNoteEnded() can't be called from the tasks, but they've all finished by now
+    for (size_t v = 0; v < voices.size(); ++v)
+    {
+        if (voiceEndedAt[v] >= 0)
+        {
+            reportNoteEnded(voices[v].channel, voices[v].key, voiceEndedAt[v]);
+            voices[v] = Voice{};
+        }
+    }
+
+    buffer.clear();
+    for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+        for (const auto &taskMix : taskMixes)
+            buffer.addFrom(ch, 0, taskMix.data(), numSamples);
+}
+
+// This creates new instances of the plugin
+juce::AudioProcessor *JUCE_CALLTYPE createPluginFilter() { return new StressTestPlugin(); }
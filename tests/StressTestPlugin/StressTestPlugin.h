@@ -0,0 +1,90 @@
+#pragma once
+
+#include <juce_audio_processors/juce_audio_processors.h>
+JUCE_BEGIN_IGNORE_WARNINGS_GCC_LIKE("-Wunused-parameter")
+#include <clap-juce-extensions/clap-juce-extensions.h>
+JUCE_END_IGNORE_WARNINGS_GCC_LIKE
+
+// set by tests/StressTestPlugin/CMakeLists.txt for each build of the plugin
+#ifndef STRESS_TEST_WORKER_THREAD
+#define STRESS_TEST_WORKER_THREAD 0
+#endif
+#ifndef STRESS_TEST_PARALLEL_TASKS
+#define STRESS_TEST_PARALLEL_TASKS 0
+#endif
+
+/*
+ * The synth which tests/host/clap-test-host plays. Every note starts a sine voice, which fades
+ * out over a fixed release after its note off and then reports its end with reportNoteEnded().
+ * Voices come from a fixed pool, big enough for a couple of thousand overlapping notes, and a
+ * note off releases the oldest held voice on its channel and key, as the wrapper expects.
+ * The voices are rendered in groups with submitParallelTasks(), each group into its own mix,
+ * and their ends are reported once the tasks are done, so the voices are always added up in
+ * the same order. It's built more than once, with different wrapper features turned on, and
+ * the host checks that each build sounds exactly the same as the plain one.
+ */
+class StressTestPlugin : public juce::AudioProcessor,
+                         public clap_juce_extensions::clap_juce_audio_processor_capabilities
+{
+  public:
+    StressTestPlugin();
+
+    bool supportsNoteEndTracking() override { return true; }
+    bool supportsWorkerThreadProcessing() override { return STRESS_TEST_WORKER_THREAD; }
+    bool supportsParallelTasks() override { return STRESS_TEST_PARALLEL_TASKS; }
+    void parallelTaskExecute(uint32_t taskIndex) override;
+
+    const juce::String getName() const override { return JucePlugin_Name; }
+    bool acceptsMidi() const override { return true; }
+    bool producesMidi() const override { return false; }
+    bool isMidiEffect() const override { return false; }
+
+    double getTailLengthSeconds() const override { return 0.1; }
+
+    int getNumPrograms() override { return 1; }
+    int getCurrentProgram() override { return 0; }
+    void setCurrentProgram(int) override {}
+    const juce::String getProgramName(int) override { return juce::String(); }
+    void changeProgramName(int, const juce::String &) override {}
+
+    void prepareToPlay(double sampleRate, int samplesPerBlock) override;
+    void releaseResources() override {}
+    void processBlock(juce::AudioBuffer<float> &, juce::MidiBuffer &) override;
+    void processBlock(juce::AudioBuffer<double> &, juce::MidiBuffer &) override {}
+
+    bool hasEditor() const override { return false; }
+    juce::AudioProcessorEditor *createEditor() override { return nullptr; }
+
+    void getStateInformation(juce::MemoryBlock &) override {}
+    void setStateInformation(const void *, int) override {}
+
+    static constexpr int maxVoices = 4096;
+    static constexpr int releaseSamples = 2000;
+    static constexpr int numTasks = 8; // each renders every numTasks'th voice
+
+  private:
+    struct Voice
+    {
+        int channel{0}, key{-1}; // key is -1 while the voice is free
+        uint64_t age{0};         // start order, so note offs release the oldest voice first
+        double angle{0.0}, angleDelta{0.0};
+        int startAt{0};    // where the voice starts in the current block
+        int releaseAt{-1}; // where its release starts in the current block, if it does
+        int releaseLeft{0};
+        bool released{false};
+    };
+
+    void startVoice(int channel, int key, int sampleOffset);
+    void releaseVoice(int channel, int key, int sampleOffset);
+
+    /** Adds the voice to out, returning the sample it finished at, or -1 if it's still going. */
+    static int renderVoice(Voice &voice, float *out, int numSamples);
+
+    std::vector<Voice> voices;
+    std::vector<int> voiceEndedAt; // written by the voice's task, -1 if it's still going
+    std::vector<std::vector<float>> taskMixes;
+    int taskBlockSize{0};
+    uint64_t nextVoiceAge{0};
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StressTestPlugin)
+};
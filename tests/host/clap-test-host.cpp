@@ -0,0 +1,638 @@
+/*
+ * clap-test-host: a minimal CLAP host for the wrapper's stress tests and benchmarks. It loads
+ * the first plugin in a .clap, plays a long run of overlapping notes into it, a block at a
+ * time, and checks what comes back:
+ *
+ *  - every note gets exactly one CLAP_EVENT_NOTE_END, no earlier than its note off
+ *  - each block's output events are inside the block and in time order
+ *
+ * Notes are spread over all 16 channels and 64 keys, and come around to the same channel and
+ * key again while the earlier note is still held, so the wrapper has to end them oldest first.
+ * It also prints how long process() took per block, which is the benchmark.
+ *
+ * Given a --reference plugin, it plays the same notes into that too, and checks that the two
+ * sound the same once their reported latencies are taken out. That's how the wrapper's worker
+ * thread mode and parallel tasks are tested against the plain process loop. We offer no thread
+ * pool, so parallel tasks run on the wrapper's own, which it starts from on_main_thread().
+ * With --min-speedup, the plugin's mean process() time also has to beat the reference's by
+ * that factor, which is only checked on machines with more than one core.
+ *
+ * With --realtime, each block is handed over no sooner than its start would be played, the way
+ * an audio device paces its callback. That gives the worker thread build a block's worth of
+ * time to render in the background, so its process() only measures what's left on the host's
+ * thread.
+ *
+ * With --param-events, every block also gets that many CLAP_EVENT_PARAM_VALUE events for the
+ * plugin's first parameter, spread evenly over the block, like a host LFO modulating it. With
+ * --scaling as well, the plugin is run at an eighth, a quarter, a half and all of that many
+ * events, and the mean process() time per event at the most events can't be over twice what
+ * it is at the fewest. Against a plugin which splits its blocks at every event, that catches a
+ * split which costs more than linear time in the number of events.
+ *
+ *   clap-test-host <plugin.clap> [--reference <plugin.clap>] [--min-speedup factor]
+ *                  [--realtime] [--notes N] [--spacing samples] [--length samples]
+ *                  [--tail seconds] [--block-size samples] [--param-events N] [--scaling]
+ */
+
+#include <clap/clap.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace
+{
+struct Options
+{
+    const char *pluginPath{nullptr};
+    const char *referencePath{nullptr};
+    double minSpeedup{0.0}; // over the reference, 0 for no check
+    bool realtime{false};
+    int numNotes{2048};
+    int noteSpacing{3};   // samples from one note on to the next
+    int noteLength{3600}; // samples from each note on to its note off
+    double tailSeconds{1.0}; // played after the last note off
+    int blockSize{256};
+    int paramEvents{0}; // per block
+    bool scaling{false};
+    double sampleRate{48000.0};
+};
+
+bool parseOptions(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const auto hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--reference") && hasValue)
+            options.referencePath = argv[++i];
+        else if (!strcmp(argv[i], "--min-speedup") && hasValue)
+            options.minSpeedup = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--realtime"))
+            options.realtime = true;
+        else if (!strcmp(argv[i], "--notes") && hasValue)
+            options.numNotes = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--spacing") && hasValue)
+            options.noteSpacing = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--length") && hasValue)
+            options.noteLength = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--tail") && hasValue)
+            options.tailSeconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--block-size") && hasValue)
+            options.blockSize = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--param-events") && hasValue)
+            options.paramEvents = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scaling"))
+            options.scaling = true;
+        else if (argv[i][0] != '-' && options.pluginPath == nullptr)
+            options.pluginPath = argv[i];
+        else
+            return false;
+    }
+    if (options.scaling && (options.referencePath != nullptr || options.paramEvents < 8))
+        return false;
+
+    return options.pluginPath != nullptr && options.numNotes >= 0 && options.noteSpacing > 0 &&
+           options.noteLength > 0 && options.tailSeconds >= 0.0 && options.blockSize > 0 &&
+           options.paramEvents >= 0;
+}
+
+/** The plugin's library stays loaded until we exit, which JUCE is happiest with. */
+const clap_plugin_entry *loadEntry(const char *path)
+{
+#if defined(_WIN32)
+    auto module = LoadLibraryA(path);
+    if (module == nullptr)
+        return nullptr;
+    return reinterpret_cast<const clap_plugin_entry *>(GetProcAddress(module, "clap_entry"));
+#else
+    auto *module = dlopen(path, RTLD_LOCAL | RTLD_NOW);
+    if (module == nullptr)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        return nullptr;
+    }
+    return reinterpret_cast<const clap_plugin_entry *>(dlsym(module, "clap_entry"));
+#endif
+}
+
+struct Host
+{
+    Host()
+    {
+        host.clap_version = CLAP_VERSION;
+        host.host_data = this;
+        host.name = "clap-test-host";
+        host.vendor = "free-audio";
+        host.url = "";
+        host.version = "1.0.0";
+        host.get_extension = [](const clap_host *, const char *) -> const void * {
+            return nullptr;
+        };
+        host.request_restart = [](const clap_host *) {};
+        host.request_process = [](const clap_host *) {};
+        host.request_callback = [](const clap_host *h) {
+            static_cast<Host *>(h->host_data)->callbackRequested = true;
+        };
+    }
+
+    clap_host host{};
+    std::atomic<bool> callbackRequested{false};
+};
+
+union InputEvent
+{
+    clap_event_header header;
+    clap_event_note note;
+    clap_event_param_value param;
+};
+
+struct InputEvents
+{
+    std::vector<InputEvent> events;
+    clap_input_events list{this, &size, &get};
+
+    static uint32_t size(const clap_input_events *list)
+    {
+        return (uint32_t) static_cast<const InputEvents *>(list->ctx)->events.size();
+    }
+    static const clap_event_header *get(const clap_input_events *list, uint32_t index)
+    {
+        return &static_cast<const InputEvents *>(list->ctx)->events[index].header;
+    }
+};
+
+struct OutputEvents
+{
+    struct NoteEnd
+    {
+        int32_t noteId;
+        uint32_t time;
+    };
+    std::vector<NoteEnd> noteEnds;
+    std::vector<uint32_t> times;
+    clap_output_events list{this, &tryPush};
+
+    void clear()
+    {
+        noteEnds.clear();
+        times.clear();
+    }
+
+    static bool tryPush(const clap_output_events *list, const clap_event_header *event)
+    {
+        auto &self = *static_cast<OutputEvents *>(list->ctx);
+        self.times.push_back(event->time);
+        if (event->space_id == CLAP_CORE_EVENT_SPACE_ID && event->type == CLAP_EVENT_NOTE_END)
+            self.noteEnds.push_back(
+                {reinterpret_cast<const clap_event_note *>(event)->note_id, event->time});
+        return true;
+    }
+};
+
+/** The notes we play: note i starts at i * spacing, and cycles through channels and keys. */
+struct NotePattern
+{
+    const Options &options;
+
+    int64_t noteOnTime(int note) const { return (int64_t)note * options.noteSpacing; }
+    int64_t noteOffTime(int note) const { return noteOnTime(note) + options.noteLength; }
+    int64_t lastNoteOff() const
+    {
+        return options.numNotes > 0 ? noteOffTime(options.numNotes - 1) : 0;
+    }
+
+    clap_event_note makeEvent(int note, bool isNoteOn, int64_t blockStart) const
+    {
+        auto evt = clap_event_note();
+        evt.header.size = sizeof(clap_event_note);
+        evt.header.type = (uint16_t)(isNoteOn ? CLAP_EVENT_NOTE_ON : CLAP_EVENT_NOTE_OFF);
+        evt.header.time =
+            (uint32_t)((isNoteOn ? noteOnTime(note) : noteOffTime(note)) - blockStart);
+        evt.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+        evt.header.flags = 0;
+        evt.note_id = note;
+        evt.port_index = 0;
+        evt.channel = (int16_t)(note % 16);
+        evt.key = (int16_t)(36 + (note / 16) % 64);
+        evt.velocity = 0.8;
+        return evt;
+    }
+};
+
+/** The automation we play: an LFO on one parameter, sampled evenly over each block. */
+struct ParamAutomation
+{
+    clap_id paramId{CLAP_INVALID_ID};
+    void *cookie{nullptr};
+    double minValue{0.0}, maxValue{1.0};
+    double cyclesPerSample{0.0};
+
+    bool prepare(const clap_plugin *plugin, const Options &options)
+    {
+        auto *params =
+            static_cast<const clap_plugin_params *>(plugin->get_extension(plugin, CLAP_EXT_PARAMS));
+        auto info = clap_param_info();
+        if (params == nullptr || params->count(plugin) == 0 || !params->get_info(plugin, 0, &info))
+            return false;
+
+        paramId = info.id;
+        cookie = info.cookie;
+        minValue = info.min_value;
+        maxValue = info.max_value;
+        cyclesPerSample = 5.0 / options.sampleRate;
+        return true;
+    }
+
+    clap_event_param_value makeEvent(int64_t blockStart, uint32_t time) const
+    {
+        const auto phase = cyclesPerSample * (double)(blockStart + time);
+        const auto lfo = 0.5 + 0.5 * std::sin(2.0 * 3.14159265358979323846 * phase);
+
+        auto evt = clap_event_param_value();
+        evt.header.size = sizeof(clap_event_param_value);
+        evt.header.type = CLAP_EVENT_PARAM_VALUE;
+        evt.header.time = time;
+        evt.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+        evt.header.flags = 0;
+        evt.param_id = paramId;
+        evt.cookie = cookie;
+        evt.note_id = -1;
+        evt.port_index = -1;
+        evt.channel = -1;
+        evt.key = -1;
+        evt.value = minValue + (maxValue - minValue) * lfo;
+        return evt;
+    }
+};
+
+struct AudioPorts
+{
+    std::vector<std::vector<float>> samples;
+    std::vector<std::vector<float *>> channels; // per port
+    std::vector<clap_audio_buffer> buffers;
+
+    void prepare(const clap_plugin *plugin, bool isInput, int blockSize)
+    {
+        auto *ports = static_cast<const clap_plugin_audio_ports *>(
+            plugin->get_extension(plugin, CLAP_EXT_AUDIO_PORTS));
+        const auto numPorts = ports != nullptr ? ports->count(plugin, isInput) : 0;
+        channels.resize(numPorts);
+        buffers.resize(numPorts);
+        for (uint32_t port = 0; port < numPorts; ++port)
+        {
+            auto info = clap_audio_port_info();
+            ports->get(plugin, port, isInput, &info);
+            for (uint32_t ch = 0; ch < info.channel_count; ++ch)
+                samples.emplace_back((size_t)blockSize, 0.0f);
+
+            auto &buffer = buffers[port];
+            buffer = clap_audio_buffer();
+            buffer.channel_count = info.channel_count;
+        }
+
+        // only point at the samples once they've stopped moving
+        size_t next = 0;
+        for (uint32_t port = 0; port < numPorts; ++port)
+        {
+            for (uint32_t ch = 0; ch < buffers[port].channel_count; ++ch)
+                channels[port].push_back(samples[next++].data());
+            buffers[port].data32 = channels[port].data();
+        }
+    }
+};
+
+struct RunResult
+{
+    bool passed{true};
+    std::vector<double> blockMicroseconds;
+    std::vector<float> output; // the first output channel
+    uint32_t latency{0};
+};
+
+bool fail(RunResult &result, const char *message, int64_t value)
+{
+    fprintf(stderr, "FAIL: %s (%lld)\n", message, (long long)value);
+    result.passed = false;
+    return false;
+}
+
+/** Checks one block's output events, and the note ends among them. */
+void checkOutputEvents(RunResult &result, const OutputEvents &out, const NotePattern &pattern,
+                       int64_t blockStart, uint32_t numSamples, std::vector<int64_t> &endTimes)
+{
+    for (size_t i = 0; i < out.times.size(); ++i)
+    {
+        if (out.times[i] >= numSamples)
+            fail(result, "output event outside its block at sample", blockStart + out.times[i]);
+        if (i > 0 && out.times[i] < out.times[i - 1])
+            fail(result, "output events out of order at sample", blockStart + out.times[i]);
+    }
+
+    for (const auto &end : out.noteEnds)
+    {
+        const auto endTime = blockStart + end.time;
+        if (end.noteId < 0 || end.noteId >= (int32_t)endTimes.size())
+            fail(result, "note end for a note we never played, id", end.noteId);
+        else if (endTimes[(size_t)end.noteId] >= 0)
+            fail(result, "second note end for note", end.noteId);
+        else if (endTime < pattern.noteOffTime(end.noteId))
+            fail(result, "note end before its note off for note", end.noteId);
+        else
+            endTimes[(size_t)end.noteId] = endTime;
+    }
+}
+
+RunResult runPlugin(const Options &options, const char *pluginPath)
+{
+    RunResult result;
+    auto *entry = loadEntry(pluginPath);
+    if (entry == nullptr || !entry->init(pluginPath))
+    {
+        fail(result, "couldn't load the plugin", 0);
+        return result;
+    }
+
+    auto *factory =
+        static_cast<const clap_plugin_factory *>(entry->get_factory(CLAP_PLUGIN_FACTORY_ID));
+    if (factory == nullptr || factory->get_plugin_count(factory) == 0)
+    {
+        fail(result, "no plugins in the factory", 0);
+        return result;
+    }
+
+    Host host;
+    const auto *descriptor = factory->get_plugin_descriptor(factory, 0);
+    const auto *plugin = factory->create_plugin(factory, &host.host, descriptor->id);
+    if (plugin == nullptr || !plugin->init(plugin))
+    {
+        fail(result, "couldn't create the plugin", 0);
+        return result;
+    }
+
+    const auto blockSize = (uint32_t)options.blockSize;
+    AudioPorts inputs, outputs;
+    inputs.prepare(plugin, true, options.blockSize);
+    outputs.prepare(plugin, false, options.blockSize);
+    InputEvents in;
+    OutputEvents out;
+    in.events.reserve(4096 + (size_t)options.paramEvents);
+    out.noteEnds.reserve(4096);
+    out.times.reserve(8192);
+
+    ParamAutomation automation;
+    if (options.paramEvents > 0 && !automation.prepare(plugin, options))
+    {
+        fail(result, "no parameter to automate", 0);
+        plugin->destroy(plugin);
+        return result;
+    }
+
+    if (!plugin->activate(plugin, options.sampleRate, 1, blockSize) ||
+        !plugin->start_processing(plugin))
+    {
+        fail(result, "couldn't activate the plugin", 0);
+        plugin->destroy(plugin);
+        return result;
+    }
+
+    if (auto *latency = static_cast<const clap_plugin_latency *>(
+            plugin->get_extension(plugin, CLAP_EXT_LATENCY)))
+        result.latency = latency->get(plugin);
+
+    // the default second after the last note off is plenty for any release and latency
+    const NotePattern pattern{options};
+    const auto runLength =
+        pattern.lastNoteOff() + (int64_t)(options.tailSeconds * options.sampleRate);
+    std::vector<int64_t> endTimes((size_t)options.numNotes, -1);
+    result.output.reserve((size_t)(runLength + blockSize));
+    int nextNoteOn = 0, nextNoteOff = 0;
+    const auto runStart = std::chrono::steady_clock::now();
+
+    for (int64_t blockStart = 0; blockStart < runLength; blockStart += blockSize)
+    {
+        const auto blockEnd = blockStart + blockSize;
+        if (options.realtime)
+            std::this_thread::sleep_until(
+                runStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double>((double)blockStart /
+                                                             options.sampleRate)));
+
+        in.events.clear();
+        while (nextNoteOn < options.numNotes || nextNoteOff < nextNoteOn)
+        {
+            const auto onTime = nextNoteOn < options.numNotes ? pattern.noteOnTime(nextNoteOn)
+                                                              : blockEnd;
+            const auto offTime =
+                nextNoteOff < nextNoteOn ? pattern.noteOffTime(nextNoteOff) : blockEnd;
+            if (std::min(onTime, offTime) >= blockEnd)
+                break;
+
+            auto evt = InputEvent();
+            if (offTime <= onTime)
+                evt.note = pattern.makeEvent(nextNoteOff++, false, blockStart);
+            else
+                evt.note = pattern.makeEvent(nextNoteOn++, true, blockStart);
+            in.events.push_back(evt);
+        }
+
+        if (options.paramEvents > 0)
+        {
+            const auto numNoteEvents = (std::ptrdiff_t)in.events.size();
+            for (int i = 0; i < options.paramEvents; ++i)
+            {
+                auto evt = InputEvent();
+                evt.param = automation.makeEvent(
+                    blockStart, (uint32_t)((int64_t)i * blockSize / options.paramEvents));
+                in.events.push_back(evt);
+            }
+            std::inplace_merge(in.events.begin(), in.events.begin() + numNoteEvents,
+                               in.events.end(), [](const InputEvent &a, const InputEvent &b) {
+                                   return a.header.time < b.header.time;
+                               });
+        }
+        out.clear();
+
+        auto process = clap_process();
+        process.steady_time = blockStart;
+        process.frames_count = blockSize;
+        process.audio_inputs = inputs.buffers.data();
+        process.audio_inputs_count = (uint32_t)inputs.buffers.size();
+        process.audio_outputs = outputs.buffers.data();
+        process.audio_outputs_count = (uint32_t)outputs.buffers.size();
+        process.in_events = &in.list;
+        process.out_events = &out.list;
+
+        const auto start = std::chrono::steady_clock::now();
+        plugin->process(plugin, &process);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        result.blockMicroseconds.push_back(
+            std::chrono::duration<double, std::micro>(elapsed).count());
+
+        checkOutputEvents(result, out, pattern, blockStart, blockSize, endTimes);
+        if (!outputs.samples.empty())
+            result.output.insert(result.output.end(), outputs.samples[0].begin(),
+                                 outputs.samples[0].end());
+
+        if (host.callbackRequested.exchange(false))
+            plugin->on_main_thread(plugin);
+    }
+
+    plugin->stop_processing(plugin);
+    plugin->deactivate(plugin);
+    plugin->destroy(plugin);
+    entry->deinit();
+
+    const auto numUnended = std::count(endTimes.begin(), endTimes.end(), (int64_t)-1);
+    if (numUnended > 0)
+        fail(result, "notes which never got a note end", numUnended);
+
+    return result;
+}
+
+/** Both plugins should play the same audio, each delayed by the latency it reports. */
+void compareOutputs(RunResult &result, const RunResult &reference)
+{
+    if (result.output.size() <= result.latency || reference.output.size() <= reference.latency)
+    {
+        fail(result, "latency longer than the whole run", result.latency);
+        return;
+    }
+
+    const auto length = std::min(result.output.size() - result.latency,
+                                 reference.output.size() - reference.latency);
+    const auto *played = result.output.data() + result.latency;
+    const auto *expected = reference.output.data() + reference.latency;
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (std::abs(played[i] - expected[i]) > 1.0e-6f)
+        {
+            fail(result, "output differs from the reference at sample", (int64_t)i);
+            return;
+        }
+    }
+}
+
+double meanMicroseconds(const RunResult &result)
+{
+    double total = 0.0;
+    for (auto t : result.blockMicroseconds)
+        total += t;
+    return result.blockMicroseconds.empty() ? 0.0
+                                            : total / (double)result.blockMicroseconds.size();
+}
+
+/** How many times faster the plugin's process() is than the reference's, on average. */
+void checkSpeedup(RunResult &result, const RunResult &reference, double minSpeedup)
+{
+    const auto speedup = meanMicroseconds(reference) / meanMicroseconds(result);
+    printf("speedup over the reference: %.2fx\n", speedup);
+    if (minSpeedup <= 0.0)
+        return;
+
+    if (std::thread::hardware_concurrency() < 2)
+        printf("  not checked against %.2fx on a single core\n", minSpeedup);
+    else if (speedup < minSpeedup)
+        fail(result, "speedup over the reference, in hundredths, is below the minimum",
+             (int64_t)(speedup * 100.0));
+}
+
+void printTimings(const Options &options, const char *pluginPath, const RunResult &result)
+{
+    auto sorted = result.blockMicroseconds;
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0.0;
+    for (auto t : sorted)
+        total += t;
+
+    const auto heldNotes = (options.noteLength + options.noteSpacing - 1) / options.noteSpacing;
+    printf("%s: %d notes, %d held at once, %d param events per block\n", pluginPath,
+           options.numNotes, heldNotes, options.paramEvents);
+    printf("  %zu blocks of %d, latency %u\n", sorted.size(), options.blockSize, result.latency);
+    printf("  process(): mean %.1f us, p99 %.1f us, max %.1f us\n",
+           total / (double)sorted.size(), sorted[sorted.size() * 99 / 100], sorted.back());
+}
+
+/** Fails the result if process() time per param event more than doubles from N / 8 to N. */
+void checkScaling(RunResult &result, const Options &options)
+{
+    auto run = options;
+    double fewestPerEvent = 0.0;
+    for (int divisor = 8; divisor >= 1 && result.passed; divisor /= 2)
+    {
+        run.paramEvents = options.paramEvents / divisor;
+        const auto scaled = runPlugin(run, run.pluginPath);
+        if (!scaled.blockMicroseconds.empty())
+            printTimings(run, run.pluginPath, scaled);
+        if (!scaled.passed)
+        {
+            result.passed = false;
+            break;
+        }
+
+        const auto perEvent = meanMicroseconds(scaled) / (double)run.paramEvents;
+        printf("  %.4f us per param event\n", perEvent);
+        if (divisor == 8)
+            fewestPerEvent = perEvent;
+        else if (perEvent > 2.0 * fewestPerEvent)
+            fail(result, "time per param event more than doubled, at events per block",
+                 run.paramEvents);
+    }
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: %s <plugin.clap> [--reference <plugin.clap>] "
+                        "[--min-speedup factor] [--realtime] [--notes N] [--spacing samples] "
+                        "[--length samples] [--tail seconds] [--block-size samples] "
+                        "[--param-events N] [--scaling]\n",
+                argv[0]);
+        return 2;
+    }
+
+    if (options.scaling)
+    {
+        auto result = RunResult();
+        checkScaling(result, options);
+        printf("%s\n", result.passed ? "PASS" : "FAIL");
+        return result.passed ? 0 : 1;
+    }
+
+    auto result = runPlugin(options, options.pluginPath);
+    if (!result.blockMicroseconds.empty())
+        printTimings(options, options.pluginPath, result);
+
+    if (options.referencePath != nullptr)
+    {
+        const auto reference = runPlugin(options, options.referencePath);
+        if (!reference.blockMicroseconds.empty())
+            printTimings(options, options.referencePath, reference);
+
+        if (!reference.passed)
+            result.passed = false;
+        else if (result.passed)
+            compareOutputs(result, reference);
+
+        if (result.passed && reference.passed)
+            checkSpeedup(result, reference, options.minSpeedup);
+    }
+
+    printf("%s\n", result.passed ? "PASS" : "FAIL");
+    return result.passed ? 0 : 1;
+}